@@ -0,0 +1,50 @@
+// Per-loop scratch arena (see arena.h).
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "heartbeat.h"
+#include "memacct.h"
+
+struct ArenaOverflow {
+    ArenaOverflow *next;
+    size_t size;
+    _Alignas(ARENA_ALIGN) uint8_t data[];
+};
+
+int arena_init(Arena *a, size_t cap) {
+    // Mapped rather than malloc'd so untouched pages cost nothing.
+    void *p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    *a = (Arena){ .base = p, .cap = cap };
+    return 0;
+}
+
+void *arena_alloc_slow(Arena *a, size_t size) {
+    ArenaOverflow *o = malloc(sizeof(*o) + size);
+    if (!o) return NULL;
+    o->next = a->overflow;
+    o->size = size;
+    a->overflow = o;
+    mem_charge(MEM_ARENA, size);
+    record_metric("arena_overflow", 1);
+    return o->data;
+}
+
+void arena_reset(Arena *a) {
+    if (a->used > a->high_water) a->high_water = a->used;
+    a->used = 0;
+    while (a->overflow) {
+        ArenaOverflow *o = a->overflow;
+        a->overflow = o->next;
+        mem_release(MEM_ARENA, o->size);
+        free(o);
+    }
+}
+
+void arena_destroy(Arena *a) {
+    arena_reset(a);
+    if (a->base) munmap(a->base, a->cap);
+    *a = (Arena){ 0 };
+}
@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Bump allocator for scratch memory that lives at most one event-loop pass
+// (decoded frame descriptors, reply buffers, per-pass work lists). The loop
+// calls arena_reset() at the end of each pass; nothing is freed individually.
+// Allocation is a pointer bump in a block mapped once at startup; a request
+// that does not fit spills to a malloc'd overflow block, released at the next
+// reset and counted as arena_overflow so the block can be resized.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16
+
+typedef struct ArenaOverflow ArenaOverflow;
+
+typedef struct {
+    uint8_t *base;
+    size_t cap;
+    size_t used;
+    size_t high_water;
+    ArenaOverflow *overflow;
+} Arena;
+
+int arena_init(Arena *a, size_t cap);
+void arena_reset(Arena *a);
+void arena_destroy(Arena *a);
+void *arena_alloc_slow(Arena *a, size_t size);
+
+static inline void *arena_alloc(Arena *a, size_t size) {
+    size_t off = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (__builtin_expect(off + size > a->cap, 0)) return arena_alloc_slow(a, size);
+    a->used = off + size;
+    return a->base + off;
+}
+
+// Shrinks the most recent allocation p to keep bytes, for buffers sized for
+// the worst case before their real length is known.
+static inline void arena_trim(Arena *a, void *p, size_t keep) {
+    uint8_t *b = p;
+    if (b < a->base || b + keep > a->base + a->used) return;   // overflow block
+    if (a->used > a->high_water) a->high_water = a->used;
+    a->used = (size_t)(b - a->base) + keep;
+}
+
+#endif
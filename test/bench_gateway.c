@@ -0,0 +1,196 @@
+// Micro-benchmarks for the packet handling hot path.
+// Prints one JSON object per line: ns/op and ops/sec per benchmark variant.
+//
+// build: cmake target bench_gateway (see CMakeLists.txt)
+// usage: bench_gateway [--cpu N] [--ms N] [--filter SUBSTR]
+// Build with -DMAX_CLIENTS=N to measure larger session tables.
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heartbeat.h"
+
+#define BATCH      256
+#define WARMUP_MS  50
+
+typedef void (*BenchFn)(void *ctx, int n);
+
+static int bench_ms = 200;
+static const char *bench_filter;
+static volatile int sink;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "warning: could not pin to cpu %d\n", cpu);
+    }
+}
+
+// Runs fn in batches: WARMUP_MS untimed, then bench_ms timed, and reports.
+static void run_bench(const char *name, const char *variant, int payload, int live,
+                      BenchFn fn, void *ctx) {
+    if (bench_filter && !strstr(name, bench_filter) && !strstr(variant, bench_filter)) return;
+    uint64_t start = mono_ns();
+    while (mono_ns() - start < (uint64_t)WARMUP_MS * 1000000) fn(ctx, BATCH);
+
+    uint64_t ops = 0;
+    start = mono_ns();
+    uint64_t elapsed;
+    do {
+        fn(ctx, BATCH);
+        ops += BATCH;
+        elapsed = mono_ns() - start;
+    } while (elapsed < (uint64_t)bench_ms * 1000000);
+
+    printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"payload\":%d,\"sessions\":%d,\"live\":%d,"
+           "\"ops\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+           name, variant, payload, MAX_CLIENTS, live, (unsigned long long)ops,
+           (double)elapsed / (double)ops, (double)ops * 1e9 / (double)elapsed);
+    fflush(stdout);
+}
+
+typedef struct {
+    uint8_t packet[MAX_FRAME];
+    size_t len;
+    uint8_t out[MAX_REPLY];
+} PacketCtx;
+
+static void build_heartbeat(PacketCtx *c, int payload) {
+    c->packet[0] = 0x01;
+    c->packet[1] = (uint8_t)(payload >> 8);
+    c->packet[2] = (uint8_t)payload;
+    memset(c->packet + 3, 'h', (size_t)payload);
+    c->len = 3 + (size_t)payload;
+}
+
+static void bench_hardened(void *ctx, int n) {
+    PacketCtx *c = ctx;
+    for (int i = 0; i < n; i++) sink += process_heartbeat_hardened(c->packet, c->len, c->out);
+}
+
+static void bench_packet(void *ctx, int n) {
+    PacketCtx *c = ctx;
+    ClientSession *s = session_by_id(0);
+    for (int i = 0; i < n; i++) {
+        sink += handle_packet(s, c->packet, c->len, c->out);
+        s->inbox_len = 0;   // keep chat frames on the accept path
+    }
+}
+
+// Rotation requests fan out over all sessions, and the queue is drained each
+// time every session has had one, so every request takes the enqueue path
+// (derivation included) rather than coalescing.
+static void bench_rotate(void *ctx, int n) {
+    PacketCtx *c = ctx;
+    static int next;
+    for (int i = 0; i < n; i++) {
+        sink += handle_packet(session_by_id(next), c->packet, 1, c->out);
+        if (++next == MAX_CLIENTS) {
+            next = 0;
+            run_key_rotations(MAX_CLIENTS);
+        }
+    }
+}
+
+// Repeated requests for a session whose rotation is still pending: the
+// coalescing path, which queues nothing.
+static void bench_rotate_coalesced(void *ctx, int n) {
+    PacketCtx *c = ctx;
+    for (int i = 0; i < n; i++) sink += handle_packet(session_by_id(0), c->packet, 1, c->out);
+}
+
+static void bench_enqueue(void *ctx, int n) {
+    PacketCtx *c = ctx;
+    ClientSession *s = session_by_id(1);
+    for (int i = 0; i < n; i++) {
+        if (enqueue_message(s, c->packet, c->len) < 0) {
+            s->inbox_len = 0;
+            sink += enqueue_message(s, c->packet, c->len);
+        }
+    }
+}
+
+static void bench_reap(void *ctx, int n) {
+    (void)ctx;
+    for (int i = 0; i < n; i++) reap_idle_sessions(UINT64_MAX);
+}
+
+int main(int argc, char **argv) {
+    int cpu = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--cpu") == 0) cpu = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--ms") == 0) bench_ms = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--filter") == 0) bench_filter = argv[i + 1];
+    }
+    pin_cpu(cpu);
+    set_log_enabled(0);
+    init_sessions();
+
+    static PacketCtx c;
+    static const int hb_sizes[] = { 0, 16, 64, 256, 1024, OUT_CAP };
+    for (size_t i = 0; i < sizeof(hb_sizes) / sizeof(hb_sizes[0]); i++) {
+        build_heartbeat(&c, hb_sizes[i]);
+        run_bench("process_heartbeat_hardened", "heartbeat", hb_sizes[i], 1, bench_hardened, &c);
+        run_bench("handle_packet", "heartbeat", hb_sizes[i], 1, bench_packet, &c);
+    }
+
+    static const int chat_sizes[] = { 16, 64, 255 };
+    for (size_t i = 0; i < sizeof(chat_sizes) / sizeof(chat_sizes[0]); i++) {
+        c.packet[0] = 0x02;
+        c.packet[1] = (uint8_t)chat_sizes[i];
+        memset(c.packet + 2, 'm', (size_t)chat_sizes[i]);
+        c.len = 2 + (size_t)chat_sizes[i];
+        session_by_id(0)->authenticated = 1;
+        run_bench("handle_packet", "chat", chat_sizes[i], 1, bench_packet, &c);
+    }
+
+    c.packet[0] = 0x03;
+    run_bench("handle_packet", "rotate_key", 0, MAX_CLIENTS, bench_rotate, &c);
+    run_key_rotations(MAX_CLIENTS);
+    handle_packet(session_by_id(0), c.packet, 1, c.out);
+    run_bench("handle_packet", "rotate_key_coalesced", 0, 1, bench_rotate_coalesced, &c);
+    run_key_rotations(MAX_CLIENTS);
+
+    // Auth with a token already in the verdict cache (the reconnect-storm case).
+    static const char token[] = "ABENCHTOKEN";
+    c.packet[0] = 0x04;
+    c.packet[1] = (uint8_t)(sizeof(token) - 1);
+    memcpy(c.packet + 2, token, sizeof(token) - 1);
+    c.len = 2 + sizeof(token) - 1;
+    handle_packet(session_by_id(0), c.packet, c.len, c.out);
+    flush_auth_batch();
+    run_bench("handle_packet", "auth_cached", (int)sizeof(token) - 1, 1, bench_packet, &c);
+
+    memset(c.packet, 0, 9);
+    c.packet[0] = 0x05;
+    c.len = 9;
+    run_bench("handle_packet", "ticket_query", 0, 1, bench_packet, &c);
+
+    static const int enq_sizes[] = { 16, 64, 256, 1024 };
+    for (size_t i = 0; i < sizeof(enq_sizes) / sizeof(enq_sizes[0]); i++) {
+        memset(c.packet, 'e', (size_t)enq_sizes[i]);
+        c.len = (size_t)enq_sizes[i];
+        run_bench("enqueue_message", "append", enq_sizes[i], 1, bench_enqueue, &c);
+    }
+
+    // Scan cost with a growing share of sessions that have sent a heartbeat.
+    static const int live_pct[] = { 0, 25, 50, 100 };
+    for (size_t i = 0; i < sizeof(live_pct) / sizeof(live_pct[0]); i++) {
+        int live = MAX_CLIENTS * live_pct[i] / 100;
+        for (int j = 0; j < MAX_CLIENTS; j++) session_by_id(j)->last_heartbeat_ms = j < live ? now_ms() : 0;
+        run_bench("reap_idle_sessions", "scan", 0, live, bench_reap, NULL);
+    }
+    return 0;
+}
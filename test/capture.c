@@ -0,0 +1,78 @@
+// Traffic capture: every complete inbound frame is appended to a compact
+// binary file for offline replay (see replay.c).
+//
+// Layout: CaptureHeader, then records of
+//   varint dt_us (since previous record), varint session id, varint length, bytes.
+// Records are buffered and written once per event-loop iteration.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+
+#define CAPTURE_BUF_CAP (256 * 1024)
+
+static struct {
+    int fd;                  // -1 while disabled
+    uint64_t last_us;
+    uint8_t buf[CAPTURE_BUF_CAP];
+    size_t len;
+} cap = { .fd = -1 };
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+int capture_open(const char *path) {
+    cap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (cap.fd < 0) return -1;
+    CaptureHeader hdr = { CAPTURE_MAGIC, CAPTURE_VERSION, MAX_CLIENTS, 0 };
+    cap.last_us = mono_us();
+    memcpy(cap.buf, &hdr, sizeof(hdr));
+    cap.len = sizeof(hdr);
+    return 0;
+}
+
+void capture_flush(void) {
+    if (cap.fd < 0 || cap.len == 0) return;
+    if (write(cap.fd, cap.buf, cap.len) != (ssize_t)cap.len) {
+        printf("[warn] capture write failed, disabling capture\n");
+        close(cap.fd);
+        cap.fd = -1;
+    }
+    cap.len = 0;
+}
+
+void capture_frame(int sid, const uint8_t *frame, size_t len) {
+    if (cap.fd < 0) return;
+    if (cap.len + 30 + len > CAPTURE_BUF_CAP) capture_flush();
+    if (cap.fd < 0) return;
+    uint64_t t = mono_us();
+    cap.len += put_varint(cap.buf + cap.len, t - cap.last_us);
+    cap.len += put_varint(cap.buf + cap.len, (uint64_t)sid);
+    cap.len += put_varint(cap.buf + cap.len, len);
+    memcpy(cap.buf + cap.len, frame, len);
+    cap.len += len;
+    cap.last_us = t;
+}
+
+void capture_close(void) {
+    capture_flush();
+    if (cap.fd >= 0) close(cap.fd);
+    cap.fd = -1;
+}
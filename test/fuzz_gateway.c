@@ -0,0 +1,146 @@
+// Fuzz target for frame decoding and handle_packet, with a differential check
+// that process_heartbeat_checked agrees with process_heartbeat_hardened.
+//
+// libFuzzer: configure with CC=clang -DGATEWAY_LIBFUZZER=ON
+// standalone (the default build, -DFUZZ_STANDALONE):
+//   fuzz_gateway FILE...        replay corpus files through the target
+//   fuzz_gateway --diff N       N random differential cases, then time the
+//                               unchecked, hardened and checked parsers; fails
+//                               if checked is over DIFF_SLOWDOWN_MAX x hardened
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heartbeat.h"
+
+static void diff_heartbeat(const uint8_t *data, size_t size) {
+    static uint8_t ref[OUT_CAP], got[OUT_CAP];
+    int want = process_heartbeat_hardened(data, size, ref);
+    int have = process_heartbeat_checked(data, size, got);
+    if (want != have || (want > 0 && memcmp(ref, got, (size_t)want) != 0)) {
+        fprintf(stderr, "heartbeat parsers disagree: hardened=%d checked=%d size=%zu\n", want, have, size);
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int ready;
+    static uint8_t out[MAX_REPLY];
+    if (!ready) {
+        set_log_enabled(0);
+        init_sessions();
+        ready = 1;
+    }
+    diff_heartbeat(data, size);
+
+    // The whole input as a single (possibly malformed) packet.
+    ClientSession *s = session_by_id(size % MAX_CLIENTS);
+    if (size) handle_packet(s, data, size, out);
+
+    // The input as a byte stream, framed the way the server reassembles it.
+    size_t off = 0;
+    while (off < size) {
+        int n = frame_length(data + off, size - off);
+        if (n <= 0) break;
+        if ((size_t)n > size - off) abort();
+        handle_packet(s, data + off, (size_t)n, out);
+        off += (size_t)n;
+    }
+    flush_auth_batch();
+    run_key_rotations(MAX_CLIENTS);
+    s->inbox_len = 0;
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// handle_packet uses the checked parser because it is no slower than the
+// hardened one; timing noise between runs stays well under this margin.
+#define DIFF_SLOWDOWN_MAX 1.25
+
+typedef int (*ParseFn)(const uint8_t *, size_t, uint8_t *);
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Well-formed heartbeats only, so the unchecked parser stays in bounds.
+static double time_parser(ParseFn fn, uint8_t **pkts, size_t *lens, int n, int rounds) {
+    static uint8_t out[OUT_CAP];
+    volatile int sink = 0;
+    uint64_t t = mono_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < n; i++) sink += fn(pkts[i], lens[i], out);
+    }
+    (void)sink;
+    return (double)(mono_ns() - t) / ((double)n * rounds);
+}
+
+// Best of three runs, so one scheduling hiccup does not decide the comparison.
+static double best_time(ParseFn fn, uint8_t **pkts, size_t *lens, int n, int rounds) {
+    double best = time_parser(fn, pkts, lens, n, rounds);
+    for (int i = 0; i < 2; i++) {
+        double t = time_parser(fn, pkts, lens, n, rounds);
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+static int run_diff(long cases) {
+    static uint8_t buf[MAX_FRAME + 16];
+    uint64_t rng = 0x2545f4914f6cdd1dULL;
+    for (long c = 0; c < cases; c++) {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        size_t size = (size_t)(rng % sizeof(buf));
+        for (size_t i = 0; i < size; i++) buf[i] = (uint8_t)(rng >> (i % 56)) ^ (uint8_t)i;
+        // Bias the declared length towards the interesting boundaries.
+        if (size >= 3 && (rng & 1)) {
+            size_t declared = size - 3 + (size_t)((rng >> 8) % 3) - 1;
+            buf[1] = (uint8_t)(declared >> 8);
+            buf[2] = (uint8_t)declared;
+        }
+        buf[0] = 0x01;
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+
+    enum { N = 1024, ROUNDS = 2000 };
+    static uint8_t *pkts[N];
+    static size_t lens[N];
+    for (int i = 0; i < N; i++) {
+        size_t payload = (size_t)(i * 37) % 512;
+        pkts[i] = malloc(3 + payload);
+        pkts[i][0] = 0x01;
+        pkts[i][1] = (uint8_t)(payload >> 8);
+        pkts[i][2] = (uint8_t)payload;
+        memset(pkts[i] + 3, 'x', payload);
+        lens[i] = 3 + payload;
+    }
+    double unchecked = best_time(process_heartbeat, pkts, lens, N, ROUNDS);
+    double hardened = best_time(process_heartbeat_hardened, pkts, lens, N, ROUNDS);
+    double checked = best_time(process_heartbeat_checked, pkts, lens, N, ROUNDS);
+    printf("{\"diff_cases\":%ld,\"unchecked_ns\":%.2f,\"hardened_ns\":%.2f,\"checked_ns\":%.2f}\n",
+           cases, unchecked, hardened, checked);
+    if (checked > hardened * DIFF_SLOWDOWN_MAX) {
+        fprintf(stderr, "checked parser %.2f ns is over %.2fx the hardened %.2f ns\n",
+                checked, DIFF_SLOWDOWN_MAX, hardened);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--diff") == 0) return run_diff(atol(argv[2]));
+    static uint8_t buf[1 << 20];
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) continue;
+        size_t n = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,638 @@
+// TCP front end for the session gateway: epoll loop, frame reassembly, and
+// zero-downtime upgrade by handing live sockets to a successor process.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "heartbeat.h"
+#include "memacct.h"
+#include "outq.h"
+#include "profile.h"
+
+#define MAX_EVENTS      64
+#define TICK_MS         100
+#define REAP_EVERY_MS   1000
+#define TCP_KA_PROBES   3
+#define LOOP_ARENA_BYTES (4u << 20)
+#define PROBES_PER_PASS 1024
+#define HANDOFF_MAGIC   0x47574844u   // "GWHD"
+#define HANDOFF_VERSION 3
+#define HANDOFF_CHUNK   65536         // output backlog bytes per message after a record
+#define HANDOFF_ACK_MS  5000          // how long the predecessor waits for the successor's ack
+
+#define TAG_LISTEN  0xffffffffu
+#define TAG_HANDOFF 0xfffffffeu
+#define TAG_UDP     0xfffffffdu
+
+// Bytes received but not yet forming a complete frame, per session slot.
+typedef struct {
+    uint8_t buf[MAX_FRAME];
+    size_t len;
+} ConnInput;
+
+// One SOCK_SEQPACKET message per live session; the socket rides along as
+// SCM_RIGHTS. Output the session had not written yet follows the record in
+// HANDOFF_CHUNK-sized messages.
+// The handoff is all or nothing: the successor answers with the number of
+// sessions it adopted (a uint32_t), and only a full count commits. The
+// predecessor confirms by echoing the count, closes what the successor
+// reopens, and hangs up; on anything else both sides forget the transfer and
+// the predecessor keeps serving.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t session_size;
+    uint32_t count;
+} HandoffHeader;
+
+typedef struct {
+    ClientSession session;
+    uint32_t offline;              // offline_handoff() state of its backlog stream
+    uint64_t offline_from;
+    uint32_t outq_len;             // unsent output bytes following the record
+    uint32_t pending_len;
+    uint8_t pending[MAX_FRAME];
+} HandoffRecord;
+
+// Backlog streams detached for a handoff, per session slot.
+typedef struct {
+    int state;
+    uint64_t from;
+} HandoffStream;
+
+// A complete frame found in ConnInput.buf by the decode pass.
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} FrameDesc;
+
+static ConnInput *conn_in;      // MAX_CLIENTS entries, see map_conn_input()
+static uint64_t peer_key[MAX_CLIENTS];   // source address of each session, for ratelimit_admit
+static HugeRegion conn_in_region;
+static Arena loop_arena;        // reset at the end of every event-loop pass
+static int epfd = -1;
+static int listen_fd = -1;
+static int handoff_fd = -1;
+static volatile sig_atomic_t stop_requested;
+static int tcp_keepalive;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int watch_fd(int fd, uint32_t tag) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int tcp_listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port),
+                                .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void set_tcp_keepalive(int enabled) {
+    tcp_keepalive = enabled;
+    set_reap_trusts_sockets(enabled);
+}
+
+// Kernel dead-peer detection sized to IDLE_MS: keepalives start at half the
+// idle threshold and give up by the threshold, and TCP_USER_TIMEOUT fails a
+// socket whose sent data stays unacknowledged that long. A vanished peer then
+// surfaces as ETIMEDOUT on the next read, with no application round trips.
+// The idle reaper leaves connected sessions to this detection.
+static void tune_client_socket(int fd) {
+    if (!tcp_keepalive) return;
+    int one = 1;
+    int idle_s = IDLE_MS / 2000;
+    int intvl_s = (IDLE_MS / 1000 - idle_s) / TCP_KA_PROBES;
+    int cnt = TCP_KA_PROBES;
+    unsigned int user_timeout = IDLE_MS;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl_s, sizeof(intvl_s)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout)) < 0) {
+        record_metric("tcp_keepalive_failed", 1);
+    }
+}
+
+static int unix_seqpacket(const char *path, int do_listen) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int rc;
+    if (do_listen) {
+        unlink(path);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        if (rc == 0) rc = listen(fd, 1);
+    } else {
+        rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (rc < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_with_fd(int sock, const void *buf, size_t len, int fd) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    union {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = ctrl.space, .msg_controllen = sizeof(ctrl.space) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// Returns the message length and stores the passed descriptor (or -1) in *fd.
+static ssize_t recv_with_fd(int sock, void *buf, size_t cap, int *fd) {
+    struct iovec iov = { .iov_base = buf, .iov_len = cap };
+    union {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = ctrl.space, .msg_controllen = sizeof(ctrl.space) };
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    *fd = -1;
+    struct cmsghdr *c = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(c), sizeof(int));
+    }
+    return n;
+}
+
+static void close_session(ClientSession *s) {
+    keepalive_disarm(s->id);
+    outq_reset(s->id);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    conn_in[s->id].len = 0;
+    disconnect_session(s);
+}
+
+static const uint8_t overload_connection[] = { MSG_OVERLOAD, 0, 1, OVERLOAD_CONNECTION };
+static const uint8_t overload_chat[] = { MSG_OVERLOAD, 0, 1, OVERLOAD_CHAT };
+static const uint8_t overload_rate[] = { MSG_OVERLOAD, 0, 1, OVERLOAD_RATE };
+
+// Rate-limit key for a peer: the IPv4 address, or the /64 prefix of an IPv6
+// one, since a single host usually has a whole /64 to rotate through.
+static uint64_t address_key(const struct sockaddr_storage *ss) {
+    static const uint8_t v4_mapped[12] = { [10] = 0xff, [11] = 0xff };
+    uint64_t key = 0;
+    if (ss->ss_family == AF_INET) {
+        key = ((const struct sockaddr_in *)ss)->sin_addr.s_addr;
+    } else if (ss->ss_family == AF_INET6) {
+        const uint8_t *a = ((const struct sockaddr_in6 *)ss)->sin6_addr.s6_addr;
+        if (memcmp(a, v4_mapped, sizeof(v4_mapped)) == 0) {
+            uint32_t v4;
+            memcpy(&v4, a + 12, 4);
+            return v4;
+        }
+        memcpy(&key, a, 8);
+        key ^= 1ULL << 63;   // keep v6 prefixes apart from v4 addresses
+    }
+    return key;
+}
+
+static void accept_clients(void) {
+    for (;;) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = accept4(listen_fd, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        uint64_t key = address_key(&peer);
+        if (!ratelimit_admit(RATE_ACCEPT, key, now_ms())) {
+            send(fd, overload_rate, sizeof(overload_rate), MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+        if (mem_overloaded()) {
+            // A fresh socket's send buffer is empty, so the frame always fits.
+            send(fd, overload_connection, sizeof(overload_connection), MSG_DONTWAIT | MSG_NOSIGNAL);
+            record_metric("overload_rejected_conn", 1);
+            close(fd);
+            continue;
+        }
+        ClientSession *s = NULL;
+        for (int i = 0; i < MAX_CLIENTS && !s; i++) {
+            if (session_by_id(i)->fd < 0) s = session_by_id(i);
+        }
+        if (!s || watch_fd(fd, (uint32_t)s->id) < 0) {
+            record_metric("accept_rejected", 1);
+            close(fd);
+            continue;
+        }
+        tune_client_socket(fd);
+        reset_session(s);
+        peer_key[s->id] = key;
+        s->fd = fd;
+        s->last_heartbeat_ms = now_ms();
+        conn_in[s->id].len = 0;
+        keepalive_arm(s->id);
+    }
+}
+
+// Reads what is available, decodes every complete frame, then dispatches them.
+static void service_client(ClientSession *s) {
+    ConnInput *in = &conn_in[s->id];
+    uint64_t t0 = profile_begin();
+    ssize_t n = read(s->fd, in->buf + in->len, sizeof(in->buf) - in->len);
+    profile_end(STAGE_READ, t0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        if (n < 0 && errno == ETIMEDOUT) record_metric("tcp_dead_peer", 1);
+        close_session(s);
+        return;
+    }
+    if (n < 0) return;
+    in->len += (size_t)n;
+    uint64_t t = now_ms();
+
+    // At most one frame per byte; the array lives until the end of the pass.
+    FrameDesc *frames = arena_alloc(&loop_arena, sizeof(FrameDesc) * in->len);
+    if (!frames) return;
+    size_t off = 0;
+    int nframes = 0, malformed = 0;
+    t0 = profile_begin();
+    for (;;) {
+        int flen = frame_length(in->buf + off, in->len - off);
+        if (flen <= 0) {
+            malformed = flen < 0;
+            break;
+        }
+        frames[nframes++] = (FrameDesc){ (uint32_t)off, (uint32_t)flen };
+        off += (size_t)flen;
+    }
+    profile_end(STAGE_DECODE, t0);
+
+    for (int i = 0; i < nframes; i++) {
+        const uint8_t *frame = in->buf + frames[i].off;
+        size_t flen = frames[i].len;
+        capture_frame(s->id, frame, flen);
+        metrics_observe_frame(flen);
+        uint8_t ptype = frame[0];
+        if (ptype == 0x02 && mem_overloaded()) {
+            outq_push(&loop_arena, s->id, overload_chat, sizeof(overload_chat));
+            record_metric("overload_rejected_chat", 1);
+            continue;
+        }
+        // Auth and resume attempts are charged to the source address before
+        // they reach the auth cache or the pending batch.
+        if ((ptype == 0x04 || ptype == 0x05) && !ratelimit_admit(RATE_AUTH, peer_key[s->id], t)) {
+            outq_push(&loop_arena, s->id, overload_rate, sizeof(overload_rate));
+            continue;
+        }
+        // Replies are queued by reference, so each gets its own arena buffer,
+        // trimmed to what handle_packet wrote.
+        uint8_t *out = arena_alloc(&loop_arena, MAX_REPLY);
+        if (!out) break;
+        t0 = profile_begin();
+        int rc = handle_packet(s, frame, flen, out);
+        profile_end(STAGE_DISPATCH, t0);
+        int answered = rc >= 0 && keepalive_activity(s->id, t, frame, flen);
+        // Echoes are skipped while a backlog streams so they cannot split its
+        // messages, and for the heartbeat that answers a server probe.
+        int reply = rc > 0 && !(ptype == 0x01 && (answered || offline_pending(s->id)));
+        arena_trim(&loop_arena, out, reply ? (size_t)rc : 0);
+        if (reply) outq_push(&loop_arena, s->id, out, (size_t)rc);
+    }
+    if (malformed) {
+        log_warn("malformed frame", s->id);
+        close_session(s);
+        return;
+    }
+    memmove(in->buf, in->buf + off, in->len - off);
+    in->len -= off;
+}
+
+static void flush_output(void);
+
+// Old process side: ship the listener and every live session, including
+// output not yet written and where its offline backlog stream stands, then
+// let go of them.
+static int handoff_to_successor(void) {
+    int c = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (c < 0) return -1;
+    // Pending logins and key rotations finish here: the snapshot below
+    // carries their results, not the queues.
+    run_key_rotations(MAX_CLIENTS);
+    flush_auth_batch();
+    flush_output();  // replies queued this pass move into the backlogs shipped below
+    HandoffHeader hdr = { HANDOFF_MAGIC, HANDOFF_VERSION, sizeof(ClientSession), 0 };
+    for (int i = 0; i < MAX_CLIENTS; i++) hdr.count += session_by_id(i)->fd >= 0;
+    if (send_with_fd(c, &hdr, sizeof(hdr), listen_fd) < 0) {
+        close(c);
+        return -1;
+    }
+    static HandoffRecord rec;
+    static HandoffStream streams[MAX_CLIENTS];
+    memset(streams, 0, sizeof(streams));
+    int rc = 0;
+    for (int i = 0; i < MAX_CLIENTS && rc == 0; i++) {
+        ClientSession *s = session_by_id(i);
+        if (s->fd < 0) continue;
+        const uint8_t *out;
+        memcpy(&rec.session, s, sizeof(*s));
+        streams[i].state = offline_handoff(i, &streams[i].from);
+        rec.offline = (uint32_t)streams[i].state;
+        rec.offline_from = streams[i].from;
+        rec.outq_len = (uint32_t)outq_peek(i, &out);
+        rec.pending_len = (uint32_t)conn_in[i].len;
+        memcpy(rec.pending, conn_in[i].buf, conn_in[i].len);
+        rc = send_with_fd(c, &rec, offsetof(HandoffRecord, pending) + rec.pending_len, s->fd);
+        for (size_t off = 0; rc == 0 && off < rec.outq_len; off += HANDOFF_CHUNK) {
+            size_t len = rec.outq_len - off < HANDOFF_CHUNK ? rec.outq_len - off : HANDOFF_CHUNK;
+            rc = send(c, out + off, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+        }
+    }
+    uint32_t ack = 0;
+    struct timeval tv = { HANDOFF_ACK_MS / 1000, HANDOFF_ACK_MS % 1000 * 1000 };
+    if (rc == 0 && (setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+                    recv(c, &ack, sizeof(ack), 0) != sizeof(ack) || ack != hdr.count ||
+                    send(c, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack))) {
+        printf("[warn] handoff not acknowledged (%u of %u sessions), still serving\n", ack, hdr.count);
+        rc = -1;
+    }
+    // The successor opens the log and the session store once we hang up, so
+    // both must be synced and closed by then; on failure we keep using them.
+    if (rc == 0) {
+        wal_close();
+        close_session_store();
+    }
+    close(c);
+    if (rc < 0) {
+        // Still serving: pick the detached streams back up.
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (streams[i].state) offline_adopt(session_by_id(i), streams[i].state, streams[i].from);
+        }
+        return -1;
+    }
+    // The successor owns the sockets now; close our copies without parking sessions.
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientSession *s = session_by_id(i);
+        if (s->fd >= 0) close(s->fd);
+        keepalive_disarm(i);
+        outq_reset(i);
+        s->fd = -1;
+    }
+    printf("[info] handed off %u sessions to successor\n", hdr.count);
+    return 0;
+}
+
+// Server keepalive probe: a MSG_PROBE carrying the send time. The client
+// answers with an ordinary heartbeat carrying the same 8 bytes, which is not
+// echoed.
+static void send_probes(uint64_t t) {
+    int *due = arena_alloc(&loop_arena, sizeof(int) * PROBES_PER_PASS);
+    uint8_t *probe = arena_alloc(&loop_arena, MSG_HEADER + 8);   // shared by every queue this pass
+    int n = due && probe ? keepalive_due(t, due, PROBES_PER_PASS) : 0;
+    if (!n) return;
+    msg_header(probe, MSG_PROBE, 8);
+    for (int i = 0; i < 8; i++) probe[MSG_HEADER + i] = (uint8_t)(t >> (56 - 8 * i));
+    for (int i = 0; i < n; i++) {
+        ClientSession *s = session_by_id(due[i]);
+        // A probe must not land inside a backlog frame; the backlog is traffic anyway.
+        if (s->fd < 0 || offline_pending(s->id)) continue;
+        outq_push(&loop_arena, s->id, probe, MSG_HEADER + 8);
+        record_metric("keepalive_probe", 1);
+    }
+}
+
+// Writes every queued reply, one sendmsg per session, and keeps EPOLLOUT
+// armed exactly while a session has a backlog. Slow consumers are not read
+// from until their backlog drains.
+static void flush_output(void) {
+    int *changed = arena_alloc(&loop_arena, sizeof(int) * MAX_CLIENTS);
+    if (!changed) return;
+    uint64_t t0 = profile_begin();
+    int n = outq_flush_all(changed, MAX_CLIENTS);
+    profile_end(STAGE_WRITE, t0);
+    for (int i = 0; i < n; i++) {
+        ClientSession *s = session_by_id(changed[i]);
+        int st = outq_state(s->id);
+        if (st == OUTQ_FAILED) {
+            close_session(s);
+            continue;
+        }
+        uint32_t mask = st == OUTQ_IDLE ? EPOLLIN : st == OUTQ_BLOCKED ? EPOLLIN | EPOLLOUT : EPOLLOUT;
+        struct epoll_event ev = { .events = mask, .data.u32 = (uint32_t)s->id };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    }
+}
+
+// Closes the connections of sessions the reaper logged out (their heartbeat
+// time is cleared); the clients come back with their resume tickets.
+static void close_reaped(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientSession *s = session_by_id(i);
+        if (s->fd >= 0 && !s->last_heartbeat_ms) close_session(s);
+    }
+}
+
+static int serve(const char *handoff_path) {
+    struct sigaction sa = { .sa_handler = on_stop_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    mem_account_inboxes();
+
+    if (handoff_path) {
+        handoff_fd = unix_seqpacket(handoff_path, 1);
+        if (handoff_fd < 0 || watch_fd(handoff_fd, TAG_HANDOFF) < 0) return -1;
+    }
+    if (watch_fd(listen_fd, TAG_LISTEN) < 0 || arena_init(&loop_arena, LOOP_ARENA_BYTES) < 0) return -1;
+    if (udp_heartbeat_fd() >= 0 && watch_fd(udp_heartbeat_fd(), TAG_UDP) < 0) return -1;
+
+    uint64_t last_reap = now_ms();
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, wal_pending() ? 1 : TICK_MS);
+        uint64_t pass_start = mono_ns();
+        int handed_off = 0;
+        for (int i = 0; i < n && !handed_off; i++) {
+            uint32_t tag = events[i].data.u32;
+            if (tag == TAG_LISTEN) {
+                accept_clients();
+            } else if (tag == TAG_HANDOFF) {
+                handed_off = handoff_to_successor() == 0;
+            } else if (tag == TAG_UDP) {
+                udp_heartbeat_service();
+            } else if (session_by_id((int)tag)->fd >= 0 && (events[i].events & ~EPOLLOUT)) {
+                // Writability alone is handled by flush_output below.
+                service_client(session_by_id((int)tag));
+            }
+        }
+        // The listener and the sessions belong to the successor now; the rest
+        // of this batch must not accept or read on them.
+        if (handed_off) break;
+        run_key_rotations(MAX_CLIENTS);
+        flush_auth_batch();
+        uint64_t t = now_ms();
+        send_probes(t);
+        flush_output();
+        uint64_t t0 = profile_begin();
+        offline_flush();
+        profile_end(STAGE_FORWARD, t0);
+        capture_flush();
+        if (wal_commit(0) < 0) printf("[warn] wal commit failed\n");
+        if (t - last_reap >= REAP_EVERY_MS) {
+            if (reap_idle_sessions(IDLE_MS)) close_reaped();
+            last_reap = t;
+        }
+        metrics_sample();
+        metrics_observe_loop(mono_ns() - pass_start);
+        profile_tick();
+        arena_reset(&loop_arena);
+    }
+    arena_destroy(&loop_arena);
+    wal_close();
+    close_session_store();
+    capture_close();
+    udp_heartbeat_close();
+    if (handoff_fd >= 0) close(handoff_fd);
+    close(listen_fd);
+    close(epfd);
+    huge_unmap(&conn_in_region);
+    conn_in = NULL;
+    return 0;
+}
+
+// Serves on port; with handoff_path set, a successor may take over via that socket.
+// The per-connection input buffers are the largest table in the server
+// (MAX_FRAME bytes per slot), so they get the same placement as the sessions.
+static int map_conn_input(void) {
+    if (conn_in) return 0;
+    if (huge_map(&conn_in_region, sizeof(ConnInput) * MAX_CLIENTS, "connection buffers") < 0) return -1;
+    conn_in = conn_in_region.p;
+    return 0;
+}
+
+int run_gateway_server(int port, const char *handoff_path) {
+    if (map_conn_input() < 0) return -1;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    listen_fd = tcp_listen(port);
+    if (epfd < 0 || listen_fd < 0) return -1;
+    return serve(handoff_path);
+}
+
+// Receives the unsent output that follows a session's handoff record.
+static int adopt_output(int c, int sid, uint32_t len) {
+    uint8_t *buf = malloc(len);
+    if (!buf) return -1;
+    size_t got = 0;
+    ssize_t n;
+    while (got < len && (n = recv(c, buf + got, len - got, 0)) > 0) got += (size_t)n;
+    int rc = got == len ? outq_adopt(sid, buf, len) : -1;
+    free(buf);
+    return rc;
+}
+
+// New process side: adopt the predecessor's listener and sessions, then serve
+// and accept the next upgrade on the same handoff path. With store_path set,
+// the adopted table moves into the session store the predecessor let go of.
+int run_gateway_takeover(const char *handoff_path, const char *store_path) {
+    if (map_conn_input() < 0) return -1;
+    int c = unix_seqpacket(handoff_path, 0);
+    if (c < 0) return -1;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    HandoffHeader hdr;
+    if (epfd < 0 || recv_with_fd(c, &hdr, sizeof(hdr), &listen_fd) != sizeof(hdr) ||
+        listen_fd < 0 || hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+        hdr.session_size != sizeof(ClientSession)) {
+        close(c);
+        return -1;
+    }
+    static HandoffRecord rec;
+    static HandoffStream streams[MAX_CLIENTS];
+    uint32_t adopted = 0;
+    int rc = 0;
+    while (rc == 0 && adopted < hdr.count) {
+        int fd;
+        ssize_t n = recv_with_fd(c, &rec, sizeof(rec), &fd);
+        int id = rec.session.id;
+        if (fd < 0 || n < (ssize_t)offsetof(HandoffRecord, pending) || id < 0 || id >= MAX_CLIENTS ||
+            (size_t)n != offsetof(HandoffRecord, pending) + rec.pending_len || session_by_id(id)->fd >= 0) {
+            if (fd >= 0) close(fd);
+            rc = -1;
+            break;
+        }
+        ClientSession *s = session_by_id(id);
+        memcpy(s, &rec.session, sizeof(*s));
+        atomic_store(&s->rotation_pending, 0);  // the predecessor drained its queue first
+        s->fd = fd;
+        if (s->authenticated && s->resume_ticket) udp_ticket_issued(id, s->resume_ticket);
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        peer_key[id] = getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0 ? address_key(&peer) : 0;
+        conn_in[id].len = rec.pending_len;
+        memcpy(conn_in[id].buf, rec.pending, rec.pending_len);
+        watch_fd(fd, (uint32_t)id);
+        keepalive_arm(id);
+        streams[id] = (HandoffStream){ (int)rec.offline, rec.offline_from };
+        adopted++;
+        if (rec.outq_len && adopt_output(c, id, rec.outq_len) < 0) rc = -1;
+    }
+    uint32_t commit = 0;
+    if (rc < 0 || send(c, &adopted, sizeof(adopted), MSG_NOSIGNAL) != sizeof(adopted) ||
+        recv(c, &commit, sizeof(commit), 0) != sizeof(commit) || commit != adopted) {
+        // The predecessor keeps every session; drop our copies.
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (session_by_id(i)->fd >= 0) close(session_by_id(i)->fd);
+        }
+        printf("[warn] takeover aborted after %u of %u sessions\n", adopted, hdr.count);
+        close(listen_fd);
+        close(c);
+        return -1;
+    }
+    // Committed. The predecessor closes its log and store, then hangs up.
+    while (recv(c, &commit, sizeof(commit), 0) > 0) {}
+    close(c);
+    if (adopt_session_store(store_path) < 0) printf("[warn] session store: cannot reopen %s\n", store_path);
+    // Segments changed while the predecessor kept storing and delivering.
+    offline_reindex();
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (streams[i].state) offline_adopt(session_by_id(i), streams[i].state, streams[i].from);
+    }
+    printf("[info] took over %u sessions\n", adopted);
+    if (wal_open() < 0) return -1;
+    return serve(handoff_path);
+}
@@ -0,0 +1,695 @@
+// Tests for the gateway modules that work on real files and sockets.
+//
+// usage: gateway_tests MODE
+//   wal        WAL replay: a crash between rotation and deleting the old
+//              segment, and a torn tail cut off the newest segment
+//   offline    offline store: index rebuild over a torn segment, a stream cut
+//              short mid-frame resuming at that frame, backlogs following the
+//              user rather than the slot, and index entries freed once drained
+//   outq       output queues against a small socket buffer: the slow-consumer
+//              hysteresis and each hard-limit policy
+//   ratelimit  admission buckets: burst cap, refill rate, one bucket per key
+//   keepalive  probe wheel: first probe before the idle threshold, traffic
+//              pushing it out, retries running out, answers matched by stamp
+//   auth       verdict cache (positive and negative) and single-use tickets
+//   udp        heartbeats by ticket over a real socket: live tickets echoed,
+//              unknown and stale ones dropped
+//
+// Modules keep their state in static tables, so every mode is its own process
+// (one ctest entry each) and starts from a clean slate.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+#include "outq.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+static char tmp_dir[64];
+
+static int make_tmp_dir(void) {
+    snprintf(tmp_dir, sizeof(tmp_dir), "/tmp/gateway_tests-XXXXXX");
+    return mkdtemp(tmp_dir) ? 0 : -1;
+}
+
+static void remove_tree(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d && (e = readdir(d))) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (e->d_name[0] == '.') continue;
+        if (e->d_type == DT_DIR) remove_tree(path);
+        else unlink(path);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+}
+
+static void remove_tmp_dir(void) {
+    remove_tree(tmp_dir);
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static int append_file(const char *path, const void *buf, size_t len) {
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, buf, len);
+    close(fd);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+// Non-blocking stream pair; sndbuf > 0 shrinks the sending side's buffer.
+static int stream_pair(int sv[2], int sndbuf) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) return -1;
+    if (sndbuf > 0) setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    return 0;
+}
+
+static size_t drain(int fd, uint8_t *buf, size_t cap) {
+    size_t got = 0;
+    ssize_t n;
+    while (got < cap && (n = read(fd, buf + got, cap - got)) > 0) got += (size_t)n;
+    return got;
+}
+
+static int path_exists(const char *path) {
+    return access(path, F_OK) == 0;
+}
+
+// Logs s in the way the transport does: an auth frame, then the batch pass.
+static void login(ClientSession *s, const char *token) {
+    uint8_t frame[2 + MAX_TOKEN], out[MAX_REPLY];
+    size_t len = strlen(token);
+    frame[0] = 0x04;
+    frame[1] = (uint8_t)len;
+    memcpy(frame + 2, token, len);
+    handle_packet(s, frame, 2 + len, out);
+    flush_auth_batch();
+}
+
+static int chat(ClientSession *s, const char *msg) {
+    uint8_t frame[2 + 255], out[MAX_REPLY];
+    size_t len = strlen(msg);
+    frame[0] = 0x02;
+    frame[1] = (uint8_t)len;
+    memcpy(frame + 2, msg, len);
+    return handle_packet(s, frame, 2 + len, out);
+}
+
+// ---- write-ahead log ------------------------------------------------------
+
+#define WAL_TEST_SEGMENT 4096
+#define OFF_HDR          16      // OfflineHeader
+
+static int resume(ClientSession *s, uint64_t ticket) {
+    uint8_t frame[9] = { 0x05 }, out[MAX_REPLY];
+    for (int i = 0; i < 8; i++) frame[1 + i] = (uint8_t)(ticket >> (56 - 8 * i));
+    return handle_packet(s, frame, sizeof(frame), out);
+}
+
+static int test_wal(void) {
+    static uint8_t want[4][MAX_MSG];
+    size_t want_len[4];
+    uint64_t ticket[4];
+    char seg0[128], seg1[128], seg2[128], saved[128], off_dir[128], off_seg[300];
+    CHECK(make_tmp_dir() == 0);
+    snprintf(seg0, sizeof(seg0), "%s/wal-00000000.log", tmp_dir);
+    snprintf(seg1, sizeof(seg1), "%s/wal-00000001.log", tmp_dir);
+    snprintf(seg2, sizeof(seg2), "%s/wal-00000002.log", tmp_dir);
+    snprintf(saved, sizeof(saved), "%s/saved", tmp_dir);
+    snprintf(off_dir, sizeof(off_dir), "%s/offline", tmp_dir);
+    snprintf(off_seg, sizeof(off_seg), "%s/one.seg", off_dir);
+    init_sessions();
+    wal_configure(tmp_dir, 0, WAL_TEST_SEGMENT);
+    CHECK(wal_replay() == 0);
+    CHECK(wal_open() == 0);
+
+    ClientSession *s1 = session_by_id(1), *s2 = session_by_id(2), *s3 = session_by_id(3);
+    login(s1, "Aone");
+    login(s2, "Atwo");
+    login(s3, "Athree");
+    CHECK(chat(s1, "hello") == 0);
+    CHECK(chat(s2, "gone") == 0);
+    reset_session(s2);
+    CHECK(wal_commit(1) == 0);
+
+    // Keep the first segment's inode so its deletion at rotation can be undone,
+    // as if the gateway crashed right before the unlink.
+    CHECK(link(seg0, saved) == 0);
+    uint8_t msg[1000];
+    for (int k = 0; !path_exists(seg1); k++) {
+        CHECK(k < 16);
+        memset(msg, 'a' + k, sizeof(msg));
+        reset_session(s3);
+        login(s3, "Athree");
+        CHECK(enqueue_message(s3, msg, sizeof(msg)) == 0);
+        CHECK(wal_commit(1) == 0);
+    }
+    CHECK(!path_exists(seg0));
+    CHECK(rename(saved, seg0) == 0);
+    CHECK(chat(s1, " world") == 0);
+    wal_close();
+    for (int i = 0; i < 4; i++) {
+        ticket[i] = session_by_id(i)->resume_ticket;
+        want_len[i] = session_by_id(i)->inbox_len;
+        memcpy(want[i], session_by_id(i)->inbox, want_len[i]);
+    }
+    CHECK(want_len[1] == 11 && !ticket[2] && want_len[3] == sizeof(msg));
+
+    // A record torn by the crash at the end of the newest segment.
+    off_t good = file_size(seg1);
+    uint8_t torn[10] = { 0xde, 0xad };
+    CHECK(append_file(seg1, torn, sizeof(torn)) == 0);
+
+    // The restarted gateway's slots start empty; each inbox waits under its
+    // owner's ticket, whichever slot the owner comes back on.
+    init_sessions();
+    CHECK(wal_replay() > 0);
+    CHECK(file_size(seg1) == good);
+    for (int i = 0; i < MAX_CLIENTS; i++) CHECK(session_by_id(i)->inbox_len == 0);
+    CHECK(wal_open() == 0);
+    CHECK(!path_exists(seg0) && !path_exists(seg1) && path_exists(seg2));
+    for (int i = 1; i < 4; i++) {
+        if (!ticket[i]) continue;
+        ClientSession *s = session_by_id(4 + i);
+        CHECK(resume(s, ticket[i]) > 0);
+        CHECK(s->inbox_len == want_len[i]);
+        CHECK(memcmp(s->inbox, want[i], want_len[i]) == 0);
+    }
+
+    // With the offline store open, recovered inboxes become the users' backlogs.
+    wal_close();
+    CHECK(offline_open(off_dir) == 0);
+    init_sessions();
+    CHECK(wal_replay() > 0);
+    CHECK(file_size(off_seg) == OFF_HDR + MSG_HEADER + 11);
+    for (int i = 0; i < MAX_CLIENTS; i++) CHECK(session_by_id(i)->inbox_len == 0);
+    remove_tmp_dir();
+    return 0;
+}
+
+// ---- offline store --------------------------------------------------------
+
+#define OFF_MSGS    400
+#define OFF_MSG_LEN 200
+#define OFF_FRAME   (MSG_HEADER + OFF_MSG_LEN)
+
+static int test_offline(void) {
+    static uint8_t got[OFF_MSGS * OFF_FRAME];
+    char seg[128];
+    CHECK(make_tmp_dir() == 0);
+    snprintf(seg, sizeof(seg), "%s/alice.seg", tmp_dir);
+    init_sessions();
+    CHECK(offline_open(tmp_dir) == 0);
+    for (int i = 0; i < OFF_MSGS; i++) {
+        uint8_t msg[OFF_MSG_LEN];
+        memset(msg, i, sizeof(msg));
+        CHECK(offline_store("alice", msg, sizeof(msg)) == 0);
+    }
+    const off_t full = OFF_HDR + OFF_MSGS * OFF_FRAME;
+    CHECK(file_size(seg) == full);
+
+    // A crash mid-append leaves a torn frame; the rebuild truncates it away.
+    uint8_t torn[MSG_HEADER + 50] = { MSG_CHAT, 0, OFF_MSG_LEN };
+    CHECK(append_file(seg, torn, sizeof(torn)) == 0);
+    CHECK(offline_open(tmp_dir) == 1);
+    CHECK(file_size(seg) == full);
+
+    // Stream into a small socket buffer until it fills, then drop the connection.
+    ClientSession *s = session_by_id(0);
+    snprintf(s->user, sizeof(s->user), "alice");
+    s->authenticated = 1;
+    int sv[2];
+    CHECK(stream_pair(sv, 4096) == 0);
+    s->fd = sv[0];
+    offline_deliver(s);
+    CHECK(offline_pending(0));
+    offline_flush();
+    size_t first = drain(sv[1], got, sizeof(got));
+    CHECK(first > 0 && first < (size_t)(OFF_MSGS * OFF_FRAME));
+    CHECK(offline_streaming(0));
+    offline_cancel(0);
+    CHECK(!offline_pending(0));
+    close(sv[0]);
+    close(sv[1]);
+    s->fd = -1;
+
+    // Progress is persisted at the start of the frame that was cut.
+    uint64_t whole = first / OFF_FRAME * OFF_FRAME, delivered = 0;
+    int fd = open(seg, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(pread(fd, &delivered, sizeof(delivered), 8) == (ssize_t)sizeof(delivered));
+    close(fd);
+    CHECK(delivered == OFF_HDR + whole);
+
+    // After a rebuild, the next connection gets whole frames from there on.
+    CHECK(offline_open(tmp_dir) == 1);
+    CHECK(stream_pair(sv, 0) == 0);
+    s->fd = sv[0];
+    offline_deliver(s);
+    size_t rest = 0;
+    for (int pass = 0; pass < 100 && (offline_pending(0) || rest == 0); pass++) {
+        offline_flush();
+        rest += drain(sv[1], got + rest, sizeof(got) - rest);
+    }
+    rest += drain(sv[1], got + rest, sizeof(got) - rest);
+    CHECK(!offline_pending(0));
+    CHECK(rest == OFF_MSGS * OFF_FRAME - whole);
+    for (size_t off = 0, i = whole / OFF_FRAME; off < rest; off += OFF_FRAME, i++) {
+        CHECK(got[off] == MSG_CHAT && got[off + 1] == 0 && got[off + 2] == OFF_MSG_LEN);
+        CHECK(got[off + MSG_HEADER] == (uint8_t)i && got[off + OFF_FRAME - 1] == (uint8_t)i);
+    }
+    CHECK(file_size(seg) < 0);   // fully delivered segments are unlinked
+    close(sv[0]);
+    close(sv[1]);
+    s->fd = -1;
+    remove_tmp_dir();
+    return 0;
+}
+
+#define OFF_USERS 600   // more than the index holds at once
+
+// Connects a fresh client to slot 0 the way accept_clients does.
+static void connect_slot(ClientSession *s, int sv[2]) {
+    reset_session(s);
+    stream_pair(sv, 0);
+    s->fd = sv[0];
+}
+
+static void disconnect_slot(ClientSession *s, int sv[2]) {
+    disconnect_session(s);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static int test_offline_users(void) {
+    static const uint8_t hello[] = { MSG_CHAT, 0, 5, 'h', 'e', 'l', 'l', 'o' };
+    uint8_t got[64];
+    char seg[300], token[32];
+    int sv[2];
+    CHECK(make_tmp_dir() == 0);
+    snprintf(seg, sizeof(seg), "%s/alice.seg", tmp_dir);
+    init_sessions();
+    CHECK(offline_open(tmp_dir) == 0);
+    ClientSession *s = session_by_id(0);
+
+    connect_slot(s, sv);
+    login(s, "Aalice");
+    CHECK(s->authenticated && strcmp(s->user, "alice") == 0);
+    CHECK(chat(s, "hello") == 0);
+    disconnect_slot(s, sv);
+    CHECK(file_size(seg) > 0);
+
+    // Another user on the same slot, before and after logging in, gets nothing.
+    connect_slot(s, sv);
+    offline_deliver(s);
+    CHECK(!offline_pending(0));
+    login(s, "Abob");
+    CHECK(s->authenticated && strcmp(s->user, "bob") == 0);
+    CHECK(!offline_pending(0));
+    offline_flush();
+    CHECK(drain(sv[1], got, sizeof(got)) == 0);
+    disconnect_slot(s, sv);
+
+    // Alice gets her backlog on whichever slot she logs in.
+    s = session_by_id(1);
+    connect_slot(s, sv);
+    login(s, "Aalice");
+    CHECK(offline_pending(1));
+    offline_flush();
+    CHECK(drain(sv[1], got, sizeof(got)) == sizeof(hello));
+    CHECK(memcmp(got, hello, sizeof(hello)) == 0);
+    CHECK(!offline_pending(1) && !path_exists(seg));
+    disconnect_slot(s, sv);
+
+    // Drained users give their index entries back.
+    s = session_by_id(0);
+    for (int i = 0; i < OFF_USERS; i++) {
+        snprintf(token, sizeof(token), "Au%d", i);
+        connect_slot(s, sv);
+        login(s, token);
+        CHECK(chat(s, "hello") == 0);
+        disconnect_slot(s, sv);
+        snprintf(seg, sizeof(seg), "%s/u%d.seg", tmp_dir, i);
+        CHECK(file_size(seg) > 0);
+        connect_slot(s, sv);
+        login(s, token);
+        offline_flush();
+        CHECK(drain(sv[1], got, sizeof(got)) == sizeof(hello));
+        CHECK(!offline_pending(0));
+        disconnect_slot(s, sv);
+    }
+    remove_tmp_dir();
+    return 0;
+}
+
+// ---- output queues ------------------------------------------------------
+
+#define OQ_REPLIES   100
+#define OQ_REPLY_LEN 1000
+#define OQ_SOFT      8192
+#define OQ_HARD      32768
+
+static uint8_t oq_replies[OQ_REPLIES][OQ_REPLY_LEN];
+
+// Checks that buf holds whole replies in send order; fills the first and last
+// sequence numbers seen and returns how many replies there were, or -1.
+static int parse_replies(const uint8_t *buf, size_t len, int *first, int *last) {
+    int n = 0, prev = -1;
+    if (len % OQ_REPLY_LEN) return -1;
+    for (size_t off = 0; off < len; off += OQ_REPLY_LEN, n++) {
+        int seq = buf[off + 1] << 8 | buf[off + 2];
+        if (buf[off] != 0xa5 || seq <= prev || seq >= OQ_REPLIES) return -1;
+        if (memcmp(buf + off, oq_replies[seq], OQ_REPLY_LEN) != 0) return -1;
+        if (!n) *first = seq;
+        *last = prev = seq;
+    }
+    return n;
+}
+
+// Queues every reply in one pass against a peer that is not reading, then
+// drains the peer until the queue is idle. Returns the replies received in
+// got (-1 when the queue failed), or -2 when a check failed.
+static int run_policy(Arena *a, int policy, int *first, int *last) {
+    static uint8_t got[OQ_REPLIES * OQ_REPLY_LEN];
+    int sv[2], changed[MAX_CLIENTS], n, rc = -2;
+    ClientSession *s = session_by_id(0);
+    outq_set_limits(OQ_SOFT, OQ_HARD, policy);
+    if (stream_pair(sv, 4096) < 0) return -2;
+    s->fd = sv[0];
+    for (int i = 0; i < OQ_REPLIES; i++) outq_push(a, 0, oq_replies[i], OQ_REPLY_LEN);
+    n = outq_flush_all(changed, MAX_CLIENTS);
+    arena_reset(a);
+    if (n != 1 || changed[0] != 0) goto out;
+    if (outq_state(0) == OUTQ_FAILED) {
+        rc = policy == OUTQ_DISCONNECT ? -1 : -2;
+        goto out;
+    }
+    // Above the soft limit the session is SLOW, and stays so until the
+    // backlog is under half of it.
+    if (outq_state(0) != OUTQ_SLOW || outq_backlog(0) > OQ_HARD) goto out;
+    // The peer reads a little at a time so the backlog passes through the
+    // window between the two thresholds.
+    size_t len = 0;
+    int held = 0, recovered = 0;
+    for (int pass = 0; pass < 10000 && outq_state(0) != OUTQ_IDLE; pass++) {
+        size_t room = sizeof(got) - len;
+        len += drain(sv[1], got + len, room < 512 ? room : 512);
+        outq_flush_all(changed, MAX_CLIENTS);
+        size_t b = outq_backlog(0);
+        int st = outq_state(0);
+        if (b > OQ_SOFT && st != OUTQ_SLOW) goto out;
+        if (b <= OQ_SOFT / 2 && st == OUTQ_SLOW) goto out;
+        if (b <= OQ_SOFT && st == OUTQ_SLOW) held = 1;
+        if (st != OUTQ_SLOW) recovered = 1;
+    }
+    len += drain(sv[1], got + len, sizeof(got) - len);
+    if (!held || !recovered || outq_state(0) != OUTQ_IDLE || outq_backlog(0)) goto out;
+    rc = parse_replies(got, len, first, last);
+    if (rc < 0) rc = -2;
+out:
+    outq_reset(0);
+    close(sv[0]);
+    close(sv[1]);
+    s->fd = -1;
+    return rc;
+}
+
+static int test_outq(void) {
+    Arena a;
+    int first, last, n;
+    CHECK(arena_init(&a, 64 * 1024) == 0);
+    init_sessions();
+    for (int i = 0; i < OQ_REPLIES; i++) {
+        memset(oq_replies[i], i, OQ_REPLY_LEN);
+        oq_replies[i][0] = 0xa5;
+        oq_replies[i][1] = (uint8_t)(i >> 8);
+        oq_replies[i][2] = (uint8_t)i;
+    }
+
+    // Past the hard limit the session is failed, for the transport to close.
+    CHECK(run_policy(&a, OUTQ_DISCONNECT, &first, &last) == -1);
+
+    // Dropping the oldest keeps the newest reply and the one already started.
+    n = run_policy(&a, OUTQ_DROP_OLDEST, &first, &last);
+    CHECK(n > 0 && n < OQ_REPLIES);
+    CHECK(first == 0 && last == OQ_REPLIES - 1);
+
+    // Dropping the newest keeps an unbroken run from the first reply.
+    n = run_policy(&a, OUTQ_DROP_NEWEST, &first, &last);
+    CHECK(n > 0 && n < OQ_REPLIES);
+    CHECK(first == 0 && last == n - 1);
+    arena_destroy(&a);
+    return 0;
+}
+
+// ---- admission rate limiting ---------------------------------------------
+
+#define RL_PER_SEC 10    // one token per 100 ms
+#define RL_BURST   3
+
+static int admitted(uint64_t key, uint64_t t, int tries) {
+    int n = 0;
+    for (int i = 0; i < tries; i++) n += ratelimit_admit(RATE_AUTH, key, t);
+    return n;
+}
+
+static int test_ratelimit(void) {
+    const uint64_t t = 1000000;
+    ratelimit_configure(RATE_AUTH, RL_PER_SEC, RL_BURST);
+
+    // A new source starts with a full bucket, and no more.
+    CHECK(admitted(1, t, 10) == RL_BURST);
+    // Other sources have their own buckets.
+    CHECK(admitted(2, t, 10) == RL_BURST);
+    // Tokens come back at per_sec; part of one is not enough.
+    CHECK(admitted(1, t + 50, 1) == 0);
+    CHECK(admitted(1, t + 100, 10) == 1);
+    CHECK(admitted(1, t + 300, 10) == 2);
+    // A long quiet spell refills only up to the burst.
+    CHECK(admitted(1, t + 60000, 10) == RL_BURST);
+    CHECK(admitted(2, t + 60000, 10) == RL_BURST);
+
+    ratelimit_configure(RATE_AUTH, 0, 0);
+    CHECK(admitted(1, t + 60000, 10) == 10);
+    return 0;
+}
+
+// ---- keepalive probes -----------------------------------------------------
+
+#define KA_TEST_IDLE  30000   // guard is the 3 s minimum until an answer
+#define KA_TEST_GUARD 3000
+#define KA_TEST_TICK  100     // only whole elapsed wheel ticks are walked
+
+static int probe_due(uint64_t t, int *sid) {
+    int sids[MAX_CLIENTS];
+    int n = keepalive_due(t, sids, MAX_CLIENTS);
+    if (n == 1) *sid = sids[0];
+    return n;
+}
+
+static int test_keepalive(void) {
+    init_sessions();
+    keepalive_configure(KA_TEST_IDLE);
+    const uint64_t t = now_ms(), interval = KA_TEST_IDLE - KA_TEST_GUARD;
+    ClientSession *quiet = session_by_id(0), *busy = session_by_id(1);
+    quiet->last_heartbeat_ms = busy->last_heartbeat_ms = t;
+    keepalive_arm(quiet->id);
+    keepalive_arm(busy->id);
+    int sid = -1;
+
+    // Nothing is due before the earliest jittered deadline.
+    CHECK(probe_due(t + interval - interval / 8 - KA_TEST_TICK, &sid) == 0);
+
+    // Traffic pushes the busy session out; the quiet one is probed before
+    // the idle threshold.
+    busy->last_heartbeat_ms = t + 10000;
+    CHECK(keepalive_activity(busy->id, t + 10000, (const uint8_t *)"\x03", 1) == 0);
+    uint64_t p1 = t + interval + KA_TEST_TICK;
+    CHECK(probe_due(p1, &sid) == 1 && sid == quiet->id);
+
+    // Only a heartbeat echoing a probe's send time answers it.
+    uint8_t answer[3 + 8] = { 0x01, 0, 8 };
+    CHECK(keepalive_activity(quiet->id, p1 + 10, answer, sizeof(answer)) == 0);
+
+    // One retry half a guard later, then it is left to the reaper.
+    uint64_t p2 = p1 + KA_TEST_GUARD / 2 + KA_TEST_TICK;
+    CHECK(probe_due(p2, &sid) == 1 && sid == quiet->id);
+    uint64_t p3 = p2 + KA_TEST_GUARD / 2 + KA_TEST_TICK;
+    CHECK(probe_due(p3, &sid) == 0);
+
+    // A late answer to the first probe still counts, and puts the session
+    // back on the wheel from then.
+    uint64_t heard = p3 + KA_TEST_TICK;
+    for (int i = 0; i < 8; i++) answer[3 + i] = (uint8_t)(p1 >> (56 - 8 * i));
+    quiet->last_heartbeat_ms = heard;
+    CHECK(keepalive_activity(quiet->id, heard, answer, sizeof(answer)) == 1);
+
+    // The busy session comes due in turn, counting from its last frame.
+    CHECK(probe_due(t + 10000 + interval + KA_TEST_TICK, &sid) == 1 && sid == busy->id);
+    keepalive_disarm(busy->id);
+
+    // The answer's RTT widens the quiet session's guard to 4 x RTT, so it is
+    // probed well before the first round's earliest deadline.
+    uint64_t guard = 4 * (heard - p1);
+    CHECK(probe_due(heard + KA_TEST_IDLE - guard - KA_TEST_TICK * 30, &sid) == 0);
+    CHECK(probe_due(heard + KA_TEST_IDLE - guard + KA_TEST_TICK, &sid) == 1 && sid == quiet->id);
+    CHECK(KA_TEST_IDLE - guard < interval - interval / 8);
+
+    // Disarmed (disconnected) sessions are never probed.
+    keepalive_disarm(quiet->id);
+    CHECK(probe_due(heard + 2 * KA_TEST_IDLE, &sid) == 0);
+    return 0;
+}
+
+// ---- auth cache and resume tickets ----------------------------------------
+
+static int test_auth(void) {
+    int sv[2];
+    init_sessions();
+    ClientSession *s = session_by_id(0);
+
+    // A miss waits for the batch pass; the same token again is a cache hit
+    // and resolves before it.
+    connect_slot(s, sv);
+    uint8_t frame[2 + MAX_TOKEN] = { 0x04, 6, 'A', 'c', 'a', 'r', 'o', 'l' }, out[MAX_REPLY];
+    CHECK(handle_packet(s, frame, 8, out) == 0 && !s->authenticated);
+    flush_auth_batch();
+    CHECK(s->authenticated && strcmp(s->user, "carol") == 0);
+    disconnect_slot(s, sv);
+    connect_slot(s, sv);
+    CHECK(handle_packet(s, frame, 8, out) == 0 && s->authenticated);
+    disconnect_slot(s, sv);
+
+    // Rejections are cached too: the second attempt fails at once.
+    connect_slot(s, sv);
+    frame[2] = 'B';
+    CHECK(handle_packet(s, frame, 8, out) == 0);
+    flush_auth_batch();
+    CHECK(!s->authenticated);
+    CHECK(handle_packet(s, frame, 8, out) == -1 && !s->authenticated);
+    disconnect_slot(s, sv);
+
+    // A ticket resumes its session once; the new one it hands out works in turn.
+    connect_slot(s, sv);
+    login(s, "Adave");
+    uint64_t ticket = s->resume_ticket;
+    CHECK(ticket != 0);
+    disconnect_slot(s, sv);
+    ClientSession *r = session_by_id(1);
+    connect_slot(r, sv);
+    CHECK(resume(r, ticket) == MSG_HEADER + 8);
+    CHECK(r->authenticated && strcmp(r->user, "dave") == 0);
+    uint64_t next = r->resume_ticket;
+    CHECK(next != 0 && next != ticket);
+    disconnect_slot(r, sv);
+    connect_slot(r, sv);
+    CHECK(resume(r, ticket) == -1 && !r->authenticated);
+    CHECK(resume(r, ticket ^ 0x5a5a) == -1 && !r->authenticated);
+    CHECK(resume(r, next) == MSG_HEADER + 8 && strcmp(r->user, "dave") == 0);
+    // Ticket 0 asks for the current one.
+    CHECK(resume(r, 0) == MSG_HEADER + 8 && r->resume_ticket != next);
+    disconnect_slot(r, sv);
+    return 0;
+}
+
+// ---- UDP heartbeats -------------------------------------------------------
+
+static int udp_send(int fd, const struct sockaddr_in *to, uint64_t ticket) {
+    uint8_t d[8 + 5] = { [8] = 0x01, 0, 2, 'h', 'i' };
+    for (int i = 0; i < 8; i++) d[i] = (uint8_t)(ticket >> (56 - 8 * i));
+    if (sendto(fd, d, sizeof(d), 0, (const struct sockaddr *)to, sizeof(*to)) != sizeof(d)) return -1;
+    struct pollfd p = { udp_heartbeat_fd(), POLLIN, 0 };
+    return poll(&p, 1, 1000) == 1 ? 0 : -1;
+}
+
+static int test_udp(void) {
+    static const uint8_t echo[] = { MSG_ECHO, 0, 2, 'h', 'i' };
+    uint8_t got[64];
+    int sv[2];
+    init_sessions();
+    CHECK(udp_heartbeat_open(0) == 0);
+    struct sockaddr_in to;
+    socklen_t to_len = sizeof(to);
+    CHECK(getsockname(udp_heartbeat_fd(), (struct sockaddr *)&to, &to_len) == 0);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    CHECK(fd >= 0);
+
+    ClientSession *s = session_by_id(0);
+    connect_slot(s, sv);
+    login(s, "Aerin");
+    uint64_t ticket = s->resume_ticket;
+    s->last_heartbeat_ms = 1;
+
+    // A live ticket: echoed as a framed reply, and counted as liveness.
+    CHECK(udp_send(fd, &to, ticket) == 0);
+    CHECK(udp_heartbeat_service() == 1);
+    CHECK(recv(fd, got, sizeof(got), 0) == sizeof(echo) && memcmp(got, echo, sizeof(echo)) == 0);
+    CHECK(s->last_heartbeat_ms > 1);
+
+    // Unknown tickets are dropped without a reply.
+    CHECK(udp_send(fd, &to, ticket ^ 0x5a5a) == 0);
+    CHECK(udp_heartbeat_service() == 0);
+    CHECK(recv(fd, got, sizeof(got), 0) < 0);
+
+    // So is a ticket whose session has gone, even once the slot is reused.
+    disconnect_slot(s, sv);
+    connect_slot(s, sv);
+    login(s, "Afrank");
+    CHECK(s->resume_ticket != ticket);
+    CHECK(udp_send(fd, &to, ticket) == 0);
+    CHECK(udp_heartbeat_service() == 0);
+    CHECK(recv(fd, got, sizeof(got), 0) < 0);
+    disconnect_slot(s, sv);
+
+    close(fd);
+    udp_heartbeat_close();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    set_log_enabled(0);
+    const char *mode = argc > 1 ? argv[1] : "";
+    int rc;
+    if (strcmp(mode, "wal") == 0) {
+        rc = test_wal();
+    } else if (strcmp(mode, "offline") == 0) {
+        rc = test_offline() || test_offline_users();
+    } else if (strcmp(mode, "outq") == 0) {
+        rc = test_outq();
+    } else if (strcmp(mode, "ratelimit") == 0) {
+        rc = test_ratelimit();
+    } else if (strcmp(mode, "keepalive") == 0) {
+        rc = test_keepalive();
+    } else if (strcmp(mode, "auth") == 0) {
+        rc = test_auth();
+    } else if (strcmp(mode, "udp") == 0) {
+        rc = test_udp();
+    } else {
+        fprintf(stderr, "usage: gateway_tests wal|offline|outq|ratelimit|keepalive|auth|udp\n");
+        return 2;
+    }
+    printf("%s: %s\n", mode, rc ? "FAILED" : "ok");
+    return rc;
+}
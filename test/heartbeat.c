@@ -1,54 +1,245 @@
 // Chat session gateway: keeps clients alive, records metrics, and forwards messages.
 // Telos: prove liveness without leaking memory, while maintaining responsive sessions.
 
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
-#define MAX_CLIENTS 32
-#define MAX_MSG     2048
-#define MAX_HEARTBEAT 65535
-#define OUT_CAP     4096
+#include "heartbeat.h"
+#include "memacct.h"
+#include "probes.h"
+#include "profile.h"
 
+#define ROTATE_QUEUE_CAP POW2_CEIL(MAX_CLIENTS)   // a session is queued at most once, so it never fills
+#define ROTATE_BATCH     8    // sessions derived per pass
+#define ROTATE_ROUNDS    64
+#define AUTH_CACHE_SHARDS 8      // power of two
+#define AUTH_CACHE_SLOTS  64     // per shard, power of two
+#define AUTH_CACHE_PROBE  4
+#define AUTH_CACHE_TTL_MS     30000
+#define AUTH_CACHE_NEG_TTL_MS 5000
+#define AUTH_BATCH_MAX    32
+// Parked sessions outlive their connections by up to TICKET_TTL_MS, so the
+// table holds several per session slot; the probe window grows with it so
+// a full one still rarely forces an eviction.
+#define TICKET_SLOTS      POW2_CEIL(4 * MAX_CLIENTS)
+#define TICKET_PROBE      (TICKET_SLOTS < 256 ? 4 : TICKET_SLOTS < 4096 ? 8 : 16)
+#define TICKET_TTL_MS     600000
+#define SESSION_STORE_MAGIC   0x47575353u   // "GWSS"
+#define SESSION_STORE_VERSION 2             // bump on any ClientSession layout change
+
+static ClientSession builtin_table[MAX_CLIENTS];
+static ClientSession *session_table = builtin_table;  // or a huge-page region
+static ClientSession *sessions = builtin_table;       // or the mapped session store
+
+// Header of the on-disk session store; the session array follows at offset 64.
 typedef struct {
-    int id;
-    int authenticated;
-    uint64_t last_heartbeat_ms;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t session_size;
+    uint32_t max_clients;
+    uint64_t saved_ms;
+} SessionStoreHeader;
+
+#define SESSION_STORE_DATA_OFF 64
+#define SESSION_STORE_BYTES (SESSION_STORE_DATA_OFF + sizeof(ClientSession) * MAX_CLIENTS)
+
+static SessionStoreHeader *store_hdr;
+
+static void park_session(ClientSession *s, uint64_t t);
+
+// Single-producer (packet path) / single-consumer (rotation pass) ring of session ids.
+static struct {
+    int ids[ROTATE_QUEUE_CAP];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+} rotate_queue;
+
+// Verified-token cache. Sharded by token hash so each shard can be locked
+// independently; every shard is a small bounded table with TTL'd entries.
+typedef struct {
+    uint64_t hash;
+    uint64_t expires_ms;   // 0 = empty slot
+    int verdict;           // 0 = valid, -1 = rejected
+    char token[MAX_TOKEN];
+} AuthCacheEntry;
+
+typedef struct {
+    atomic_flag lock;
+    AuthCacheEntry slots[AUTH_CACHE_SLOTS];
+} AuthCacheShard;
+
+static AuthCacheShard auth_cache[AUTH_CACHE_SHARDS];
+
+// Tokens waiting for the next batched verification pass.
+static struct {
+    int sid[AUTH_BATCH_MAX];
+    char token[AUTH_BATCH_MAX][MAX_TOKEN];
+    int len;
+} auth_pending;
+
+// Sessions parked by the idle reaper, keyed by resumption ticket. Only the
+// live part of the inbox is kept, in an exact-size allocation.
+typedef struct {
+    uint64_t ticket;       // 0 = empty slot
+    uint64_t expires_ms;
     char user[64];
-    uint8_t inbox[MAX_MSG];
+    uint8_t keys[2][KEY_LEN];
+    uint32_t key_epoch;
+    uint8_t *inbox;
     size_t inbox_len;
-} ClientSession;
+} ParkedSession;
 
-static ClientSession sessions[MAX_CLIENTS];
+static ParkedSession parked[TICKET_SLOTS];
 
-static uint64_t now_ms(void) {
+uint64_t now_ms(void) {
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
     return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void log_info(const char *msg, int sid) {
-    printf("[info] session %d: %s\n", sid, msg);
+static int log_enabled = 1;
+
+void set_log_enabled(int enabled) {
+    log_enabled = enabled;
+}
+
+void log_info(const char *msg, int sid) {
+    if (log_enabled) printf("[info] session %d: %s\n", sid, msg);
 }
 
-static void log_warn(const char *msg, int sid) {
-    printf("[warn] session %d: %s\n", sid, msg);
+void log_warn(const char *msg, int sid) {
+    if (log_enabled) printf("[warn] session %d: %s\n", sid, msg);
 }
 
-static void record_metric(const char *name, int value) {
-    // Stubbed metrics sink
-    (void)name; (void)value;
+// Logged-out state of a slot: no identity, default keys, no ticket.
+static void reset_slot(ClientSession *s) {
+    s->authenticated = 0;
+    s->last_heartbeat_ms = 0;
+    s->user[0] = '\0';
+    memset(s->keys, 0, sizeof(s->keys));
+    s->keys[0][0] = (uint8_t)s->id;
+    atomic_store(&s->key_epoch, 0);
+    s->resume_ticket = 0;
 }
 
-static void init_sessions(void) {
+void init_sessions(void) {
     for (int i = 0; i < MAX_CLIENTS; i++) {
         sessions[i].id = i;
-        sessions[i].authenticated = 0;
-        sessions[i].last_heartbeat_ms = 0;
+        reset_slot(&sessions[i]);
         sessions[i].inbox_len = 0;
-        snprintf(sessions[i].user, sizeof(sessions[i].user), "user-%02d", i);
+        atomic_store(&sessions[i].rotation_pending, 0);
+        sessions[i].fd = -1;
+    }
+    atomic_store(&rotate_queue.head, 0);
+    atomic_store(&rotate_queue.tail, 0);
+}
+
+// Maps the session table from a file so sessions survive a restart: clients
+// resume them with their tickets.
+// Returns 1 if a compatible table was remapped, 0 if the mapping is fresh (or
+// path is NULL) and the caller must init_sessions(), -1 on error (the static
+// table stays in use).
+// Maps the store file, sized for this build. Returns 1 if it holds a table
+// this build can read, 0 if it was (re)initialized, -1 on error.
+static int map_session_store(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size != (off_t)SESSION_STORE_BYTES &&
+                               ftruncate(fd, SESSION_STORE_BYTES) < 0)) {
+        close(fd);
+        return -1;
     }
+    int existed = st.st_size == (off_t)SESSION_STORE_BYTES;
+    void *map = mmap(NULL, SESSION_STORE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    huge_advise(map, SESSION_STORE_BYTES);
+
+    store_hdr = map;
+    int warm = existed &&
+               store_hdr->magic == SESSION_STORE_MAGIC &&
+               store_hdr->version == SESSION_STORE_VERSION &&
+               store_hdr->session_size == sizeof(ClientSession) &&
+               store_hdr->max_clients == MAX_CLIENTS;
+    if (!warm) {
+        store_hdr->magic = SESSION_STORE_MAGIC;
+        store_hdr->version = SESSION_STORE_VERSION;
+        store_hdr->session_size = sizeof(ClientSession);
+        store_hdr->max_clients = MAX_CLIENTS;
+        store_hdr->saved_ms = 0;
+    }
+    return warm;
+}
+
+int open_session_store(const char *path) {
+    if (!path) return 0;
+    int warm = map_session_store(path);
+    if (warm < 0) return -1;
+    sessions = (ClientSession *)((uint8_t *)store_hdr + SESSION_STORE_DATA_OFF);
+    if (!warm) return 0;
+    // The rotation queue and sockets did not survive the restart, so no slot
+    // has its client any more: authenticated sessions become resumable under
+    // their tickets and every slot starts logged out for whoever connects.
+    uint64_t t = now_ms();
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientSession *s = &sessions[i];
+        atomic_store(&s->rotation_pending, 0);
+        s->fd = -1;
+        if (s->authenticated && s->resume_ticket) park_session(s, t);
+        s->inbox_len = 0;    // never charged in this process; the parked copy has it
+        reset_slot(s);
+    }
+    record_metric("session_store_warm", MAX_CLIENTS);
+    return 1;
+}
+
+// Moves the live table into the store after a takeover: the predecessor
+// closed the file, and the sessions it handed over are what it held. Returns
+// -1 on error (the in-memory table stays in use).
+int adopt_session_store(const char *path) {
+    if (!path || store_hdr) return 0;
+    if (map_session_store(path) < 0) return -1;
+    ClientSession *mapped = (ClientSession *)((uint8_t *)store_hdr + SESSION_STORE_DATA_OFF);
+    memcpy(mapped, sessions, sizeof(ClientSession) * MAX_CLIENTS);
+    sessions = mapped;
+    return 0;
+}
+
+// Flushes the mapped table and falls back to the in-memory one, which takes
+// over its contents.
+void close_session_store(void) {
+    if (!store_hdr) return;
+    memcpy(session_table, sessions, sizeof(ClientSession) * MAX_CLIENTS);
+    store_hdr->saved_ms = now_ms();
+    msync(store_hdr, SESSION_STORE_BYTES, MS_SYNC);
+    munmap(store_hdr, SESSION_STORE_BYTES);
+    store_hdr = NULL;
+    sessions = session_table;
+}
+
+// Moves the in-memory table onto huge pages local to this CPU's NUMA node.
+// Call before init_sessions(); the builtin table stays as the fallback.
+int place_session_table(void) {
+    static HugeRegion region;
+    if (region.p) return 0;
+    if (huge_map(&region, sizeof(ClientSession) * MAX_CLIENTS, "session table") < 0) return -1;
+    if (sessions == session_table) sessions = region.p;
+    session_table = region.p;
+    return 0;
+}
+
+ClientSession *session_by_id(int id) {
+    return &sessions[id];
 }
 
 static int clamp_int(int v, int lo, int hi) {
@@ -63,28 +254,432 @@ static void apply_backpressure(ClientSession *s) {
     }
 }
 
-static int enqueue_message(ClientSession *s, const uint8_t *buf, size_t len) {
-    if (len > MAX_MSG - s->inbox_len) return -1;
+int enqueue_message(ClientSession *s, const uint8_t *buf, size_t len) {
+    uint64_t t0 = profile_begin();
+    if (len > MAX_MSG - s->inbox_len) {
+        GW_PROBE3(enqueue__reject, s->id, len, s->inbox_len);
+        profile_end(STAGE_ENQUEUE, t0);
+        return -1;
+    }
     memcpy(s->inbox + s->inbox_len, buf, len);
     s->inbox_len += len;
+    mem_charge(MEM_INBOX, len);
+    GW_PROBE3(enqueue, s->id, len, s->inbox_len);
+    wal_append(s->id, buf, len);
     apply_backpressure(s);
+    profile_end(STAGE_ENQUEUE, t0);
     return 0;
 }
 
-static int authenticate(ClientSession *s, const char *token) {
-    if (token && token[0] == 'A') {
+static uint64_t hash_token(const char *token) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (; *token; token++) {
+        h ^= (uint8_t)*token;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// The expensive check (HMAC/signature in production). Everything else in this
+// section exists to call it as rarely as possible.
+static int verify_token_signature(const char *token) {
+    return token[0] == 'A' && token[1] ? 0 : -1;
+}
+
+// Identity a verified token proves. Stand-in tokens are the signature marker
+// followed by the subject; a real token carries it as a signed claim.
+static void token_subject(char *out, size_t cap, const char *token) {
+    snprintf(out, cap, "%s", token + 1);
+}
+
+// Returns 1 and fills *verdict on a live hit, 0 on a miss.
+static int auth_cache_lookup(const char *token, uint64_t h, uint64_t t, int *verdict) {
+    int hit = 0;
+    AuthCacheShard *shard = &auth_cache[h & (AUTH_CACHE_SHARDS - 1)];
+    while (atomic_flag_test_and_set_explicit(&shard->lock, memory_order_acquire)) {}
+    for (int p = 0; p < AUTH_CACHE_PROBE; p++) {
+        AuthCacheEntry *e = &shard->slots[((h >> 8) + p) & (AUTH_CACHE_SLOTS - 1)];
+        if (e->expires_ms > t && e->hash == h && strcmp(e->token, token) == 0) {
+            *verdict = e->verdict;
+            hit = 1;
+            break;
+        }
+    }
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+    return hit;
+}
+
+// Inserts into the first empty/expired probe slot, else evicts the one closest to expiry.
+static void auth_cache_store(const char *token, uint64_t h, uint64_t t, int verdict) {
+    if (strlen(token) >= MAX_TOKEN) return;
+    AuthCacheShard *shard = &auth_cache[h & (AUTH_CACHE_SHARDS - 1)];
+    while (atomic_flag_test_and_set_explicit(&shard->lock, memory_order_acquire)) {}
+    AuthCacheEntry *victim = NULL;
+    for (int p = 0; p < AUTH_CACHE_PROBE; p++) {
+        AuthCacheEntry *e = &shard->slots[((h >> 8) + p) & (AUTH_CACHE_SLOTS - 1)];
+        if (e->expires_ms <= t || (e->hash == h && strcmp(e->token, token) == 0)) {
+            victim = e;
+            break;
+        }
+        if (!victim || e->expires_ms < victim->expires_ms) victim = e;
+    }
+    victim->hash = h;
+    victim->verdict = verdict;
+    victim->expires_ms = t + (verdict == 0 ? AUTH_CACHE_TTL_MS : AUTH_CACHE_NEG_TTL_MS);
+    snprintf(victim->token, sizeof(victim->token), "%s", token);
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+}
+
+// Tickets are bearer credentials, so they come from the kernel CSPRNG.
+static uint64_t new_ticket(void) {
+    uint64_t t = 0;
+    while (t == 0) {
+        if (getrandom(&t, sizeof(t), 0) != sizeof(t)) t = 0;
+    }
+    return t;
+}
+
+static void log_out(ClientSession *s);
+
+// A session that logs in as someone else first logs out the previous identity,
+// so its inbox and backlog never change hands.
+static int apply_auth_result(ClientSession *s, int verdict, const char *token) {
+    if (verdict == 0) {
+        char user[sizeof(s->user)];
+        token_subject(user, sizeof(user), token);
+        if (s->authenticated && strcmp(s->user, user) != 0) log_out(s);
+        memcpy(s->user, user, sizeof(s->user));
         s->authenticated = 1;
+        if (!s->resume_ticket) s->resume_ticket = new_ticket();
+        udp_ticket_issued(s->id, s->resume_ticket);
+        wal_owner(s->id, s->user, s->resume_ticket);
+        offline_deliver(s);
+        GW_PROBE1(auth__ok, s->id);
         log_info("auth ok", s->id);
         return 0;
     }
+    GW_PROBE1(auth__fail, s->id);
     log_warn("auth failed", s->id);
     return -1;
 }
 
-static void rotate_session_key(ClientSession *s) {
-    // pretend to rotate keys; increments a simple counter metric
-    record_metric("key_rotation", s->id);
-    (void)s;
+static int authenticate(ClientSession *s, const char *token) {
+    if (!token) return apply_auth_result(s, -1, NULL);
+    uint64_t t = now_ms();
+    uint64_t h = hash_token(token);
+    int verdict;
+    if (auth_cache_lookup(token, h, t, &verdict)) {
+        record_metric("auth_cache_hit", 1);
+        return apply_auth_result(s, verdict, token);
+    }
+    record_metric("auth_cache_miss", 1);
+    verdict = verify_token_signature(token);
+    auth_cache_store(token, h, t, verdict);
+    return apply_auth_result(s, verdict, token);
+}
+
+// Verifies every pending token in one pass. Identical tokens within the batch
+// (a reconnect storm replaying the same credentials) are verified once.
+int flush_auth_batch(void) {
+    int n = auth_pending.len;
+    uint64_t t = now_ms();
+    uint64_t hashes[AUTH_BATCH_MAX];
+    int verdicts[AUTH_BATCH_MAX];
+
+    for (int i = 0; i < n; i++) {
+        hashes[i] = hash_token(auth_pending.token[i]);
+        int dup = -1;
+        for (int j = 0; j < i; j++) {
+            if (hashes[j] == hashes[i] && strcmp(auth_pending.token[j], auth_pending.token[i]) == 0) {
+                dup = j;
+                break;
+            }
+        }
+        if (dup >= 0) {
+            verdicts[i] = verdicts[dup];
+            continue;
+        }
+        verdicts[i] = verify_token_signature(auth_pending.token[i]);
+        auth_cache_store(auth_pending.token[i], hashes[i], t, verdicts[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        apply_auth_result(&sessions[auth_pending.sid[i]], verdicts[i], auth_pending.token[i]);
+    }
+    auth_pending.len = 0;
+    record_metric("auth_batch", n);
+    return n;
+}
+
+// Cache hits resolve immediately; misses are parked for flush_auth_batch().
+// Returns 0 when authenticated, 1 when pending, -1 when rejected.
+static int authenticate_deferred(ClientSession *s, const char *token) {
+    uint64_t h = hash_token(token);
+    int verdict;
+    if (auth_cache_lookup(token, h, now_ms(), &verdict)) {
+        record_metric("auth_cache_hit", 1);
+        return apply_auth_result(s, verdict, token);
+    }
+    if (auth_pending.len == AUTH_BATCH_MAX) flush_auth_batch();
+    auth_pending.sid[auth_pending.len] = s->id;
+    snprintf(auth_pending.token[auth_pending.len], MAX_TOKEN, "%s", token);
+    auth_pending.len++;
+    return 1;
+}
+
+// Forgets logins from sid still waiting for the batch pass, so a verdict
+// cannot land on whoever takes the slot next.
+static void drop_pending_auth(int sid) {
+    int n = 0;
+    for (int i = 0; i < auth_pending.len; i++) {
+        if (auth_pending.sid[i] == sid) continue;
+        if (n != i) {
+            auth_pending.sid[n] = auth_pending.sid[i];
+            memcpy(auth_pending.token[n], auth_pending.token[i], MAX_TOKEN);
+        }
+        n++;
+    }
+    auth_pending.len = n;
+}
+
+static void drop_parked(ParkedSession *p) {
+    mem_release(MEM_PARKED, p->inbox_len);
+    free(p->inbox);
+    memset(p, 0, sizeof(*p));
+}
+
+static ParkedSession *find_parked(uint64_t ticket) {
+    for (int i = 0; i < TICKET_PROBE; i++) {
+        ParkedSession *p = &parked[(ticket + i) & (TICKET_SLOTS - 1)];
+        if (p->ticket == ticket) return p;
+    }
+    return NULL;
+}
+
+// Stores an authenticated session's state under its ticket. Replaces an entry
+// already parked under it, else takes the first free or expired probe slot,
+// else evicts the entry closest to expiry; its inbox goes to the offline
+// store so the evicted user still gets it on the next login.
+static void park_session(ClientSession *s, uint64_t t) {
+    ParkedSession *victim = find_parked(s->resume_ticket);
+    if (!victim) {
+        for (int i = 0; i < TICKET_PROBE; i++) {
+            ParkedSession *p = &parked[(s->resume_ticket + i) & (TICKET_SLOTS - 1)];
+            if (p->ticket == 0 || p->expires_ms <= t) {
+                victim = p;
+                break;
+            }
+            if (!victim || p->expires_ms < victim->expires_ms) victim = p;
+        }
+    }
+    uint8_t *inbox = NULL;
+    if (s->inbox_len) {
+        inbox = malloc(s->inbox_len);
+        if (!inbox) return;
+        memcpy(inbox, s->inbox, s->inbox_len);
+        mem_charge(MEM_PARKED, s->inbox_len);
+    }
+    if (victim->ticket && victim->ticket != s->resume_ticket && victim->expires_ms > t) {
+        static unsigned evicted;
+        static size_t lost;
+        record_metric("ticket_evicted", 1);
+        if (victim->inbox_len && offline_store(victim->user, victim->inbox, victim->inbox_len) < 0) {
+            lost += victim->inbox_len;
+            record_metric("ticket_evicted_bytes_lost", (int)victim->inbox_len);
+        }
+        // Logged at powers of two so a full table cannot flood the log.
+        evicted++;
+        if ((evicted & (evicted - 1)) == 0) {
+            printf("[warn] ticket table full: %u parked sessions evicted, %zu inbox bytes lost\n", evicted, lost);
+        }
+    }
+    drop_parked(victim);
+    victim->ticket = s->resume_ticket;
+    victim->expires_ms = t + TICKET_TTL_MS;
+    memcpy(victim->user, s->user, sizeof(victim->user));
+    memcpy(victim->keys, s->keys, sizeof(victim->keys));
+    victim->key_epoch = atomic_load(&s->key_epoch);
+    victim->inbox = inbox;
+    victim->inbox_len = s->inbox_len;
+    record_metric("session_parked", 1);
+}
+
+// Restores a parked session into s without re-running auth. Tickets are
+// single-use: a fresh one is issued on success.
+static int resume_session(ClientSession *s, uint64_t ticket) {
+    uint64_t t = now_ms();
+    ParkedSession *p = find_parked(ticket);
+    if (p && p->expires_ms <= t) {
+        drop_parked(p);
+        p = NULL;
+    }
+    if (p && s->authenticated) {
+        log_out(s);                     // the slot's current identity stays resumable
+        p = find_parked(ticket);
+    }
+    if (p) {
+        memcpy(s->user, p->user, sizeof(s->user));
+        memcpy(s->keys, p->keys, sizeof(s->keys));
+        atomic_store(&s->key_epoch, p->key_epoch);
+        if (p->inbox_len) memcpy(s->inbox, p->inbox, p->inbox_len);
+        mem_release(MEM_INBOX, s->inbox_len);
+        mem_charge(MEM_INBOX, p->inbox_len);
+        s->inbox_len = p->inbox_len;
+        s->authenticated = 1;
+        s->last_heartbeat_ms = t;
+        s->resume_ticket = new_ticket();
+        udp_ticket_issued(s->id, s->resume_ticket);
+        wal_clear(s->id);
+        wal_owner(s->id, s->user, s->resume_ticket);
+        if (s->inbox_len) wal_append(s->id, s->inbox, s->inbox_len);
+        drop_parked(p);
+        offline_deliver(s);
+        log_info("session resumed", s->id);
+        return 0;
+    }
+    log_warn("resume ticket rejected", s->id);
+    return -1;
+}
+
+static void clear_inbox(ClientSession *s) {
+    if (s->inbox_len) wal_clear(s->id);
+    mem_release(MEM_INBOX, s->inbox_len);
+    s->inbox_len = 0;
+}
+
+// Moves undelivered inbox bytes to the offline store of their owner, if one
+// is open, so neither the session nor its parked copy keeps them in memory.
+static void spill_inbox(ClientSession *s) {
+    if (s->inbox_len && s->user[0] && offline_store(s->user, s->inbox, s->inbox_len) == 0) clear_inbox(s);
+}
+
+// Hands inbox bytes recovered by wal_replay() back to their owner: the
+// offline store when one is open, else the session parked under the owner's
+// last ticket, which the client resumes with. Either way they replace the
+// inbox a warm session store parked under that ticket.
+int restore_inbox(const char *user, uint64_t ticket, const uint8_t *buf, size_t len) {
+    static ClientSession tmp;
+    if (!user[0] || len > MAX_MSG) return -1;
+    ParkedSession *p = ticket ? find_parked(ticket) : NULL;
+    if (offline_store(user, buf, len) == 0) {
+        if (p && p->inbox_len) {
+            mem_release(MEM_PARKED, p->inbox_len);
+            free(p->inbox);
+            p->inbox = NULL;
+            p->inbox_len = 0;
+        }
+        return 0;
+    }
+    if (!ticket) return -1;
+    memset(&tmp, 0, sizeof(tmp));
+    if (p) {
+        memcpy(tmp.keys, p->keys, sizeof(tmp.keys));
+        atomic_store(&tmp.key_epoch, p->key_epoch);
+    }
+    snprintf(tmp.user, sizeof(tmp.user), "%s", user);
+    tmp.resume_ticket = ticket;
+    memcpy(tmp.inbox, buf, len);
+    tmp.inbox_len = len;
+    park_session(&tmp, now_ms());
+    return find_parked(ticket) ? 0 : -1;
+}
+
+// Prepares a slot for a new connection: nothing of the previous occupant (a
+// queued login, a backlog stream, inbox bytes, identity, ticket) carries over.
+void reset_session(ClientSession *s) {
+    drop_pending_auth(s->id);
+    offline_cancel(s->id);
+    clear_inbox(s);
+    reset_slot(s);
+}
+
+// Ends the identity s is logged in as: its inbox goes to the offline store
+// and an authenticated session stays resumable under its ticket.
+static void log_out(ClientSession *s) {
+    spill_inbox(s);
+    if (s->authenticated && s->resume_ticket) park_session(s, now_ms());
+    offline_cancel(s->id);
+    clear_inbox(s);
+    reset_slot(s);
+}
+
+// Connection closed: keep an authenticated session resumable, free the slot.
+void disconnect_session(ClientSession *s) {
+    drop_pending_auth(s->id);
+    log_out(s);
+    s->fd = -1;
+}
+
+// Queues a key rotation; derivation happens later in run_key_rotations().
+// Repeated requests while one is pending coalesce into a single rotation.
+static int rotate_session_key(ClientSession *s) {
+    if (atomic_exchange(&s->rotation_pending, 1)) return 0;
+    uint32_t tail = atomic_load_explicit(&rotate_queue.tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&rotate_queue.head, memory_order_acquire);
+    if (tail - head == ROTATE_QUEUE_CAP) {
+        atomic_store(&s->rotation_pending, 0);
+        record_metric("key_rotation_dropped", 1);
+        return -1;
+    }
+    rotate_queue.ids[tail & (ROTATE_QUEUE_CAP - 1)] = s->id;
+    atomic_store_explicit(&rotate_queue.tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+// Derives the next key for n sessions at once. Lanes are laid out as
+// struct-of-arrays so the mixing rounds vectorise across sessions.
+// Stand-in ARX mixer with the cost profile of a real KDF, not a secure one.
+static void derive_keys_batch(ClientSession **batch, int n) {
+    uint64_t lane[KEY_LEN / 8][ROTATE_BATCH] = {{0}};
+
+    for (int w = 0; w < KEY_LEN / 8; w++) {
+        for (int j = 0; j < n; j++) {
+            const ClientSession *s = batch[j];
+            uint32_t epoch = atomic_load_explicit(&s->key_epoch, memory_order_relaxed);
+            uint64_t v;
+            memcpy(&v, s->keys[epoch & 1] + w * 8, 8);
+            lane[w][j] = v ^ ((uint64_t)(epoch + 1) << 32) ^ (uint64_t)s->id;
+        }
+    }
+    for (int r = 0; r < ROTATE_ROUNDS; r++) {
+        for (int w = 0; w < KEY_LEN / 8; w++) {
+            for (int j = 0; j < ROTATE_BATCH; j++) {
+                uint64_t v = lane[w][j] + 0x9e3779b97f4a7c15ULL * (uint64_t)(r + w + 1);
+                v ^= v >> 30; v *= 0xbf58476d1ce4e5b9ULL;
+                v ^= v >> 27; v *= 0x94d049bb133111ebULL;
+                lane[w][j] = v ^ (v >> 31);
+            }
+        }
+    }
+    for (int j = 0; j < n; j++) {
+        ClientSession *s = batch[j];
+        uint32_t epoch = atomic_load_explicit(&s->key_epoch, memory_order_relaxed);
+        uint8_t *next = s->keys[(epoch + 1) & 1];
+        for (int w = 0; w < KEY_LEN / 8; w++) memcpy(next + w * 8, &lane[w][j], 8);
+        // Publish: readers see either the old epoch or the fully written new key.
+        atomic_store_explicit(&s->key_epoch, epoch + 1, memory_order_release);
+        atomic_store(&s->rotation_pending, 0);
+        record_metric("key_rotation", 1);
+    }
+}
+
+// Drains up to max queued rotations in batches; returns how many completed.
+int run_key_rotations(int max) {
+    int done = 0;
+    while (done < max) {
+        ClientSession *batch[ROTATE_BATCH];
+        int n = 0;
+        uint32_t head = atomic_load_explicit(&rotate_queue.head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&rotate_queue.tail, memory_order_acquire);
+        while (n < ROTATE_BATCH && head != tail && done + n < max) {
+            batch[n++] = &sessions[rotate_queue.ids[head & (ROTATE_QUEUE_CAP - 1)]];
+            head++;
+        }
+        if (n == 0) break;
+        derive_keys_batch(batch, n);
+        atomic_store_explicit(&rotate_queue.head, head, memory_order_release);
+        done += n;
+    }
+    return done;
 }
 
 static void process_chat_message(ClientSession *s, const uint8_t *msg, size_t len) {
@@ -99,7 +694,7 @@ static void process_chat_message(ClientSession *s, const uint8_t *msg, size_t le
 // NOTE: relies on caller to ensure packet is well-formed.
 int process_heartbeat(const uint8_t *packet, size_t packet_len, uint8_t *out) {
     if (packet_len < 3) return -1; // type(1) + len(2)
-    uint16_t payload_len = (packet[1] << 8) | packet[2];
+    size_t payload_len = ((size_t)packet[1] << 8) | packet[2];
     const uint8_t *payload = packet + 3;
 
     // Size cap to avoid absurd requests
@@ -107,34 +702,70 @@ int process_heartbeat(const uint8_t *packet, size_t packet_len, uint8_t *out) {
 
     // Copies declared payload; assumes caller validated bounds.
     memcpy(out, payload, payload_len);
-    return payload_len;
+    return (int)payload_len;
 }
 
 // Hardened variant with explicit bounds verification.
 int process_heartbeat_hardened(const uint8_t *packet, size_t packet_len, uint8_t *out) {
     if (packet_len < 3) return -1;
-    uint16_t payload_len = (packet[1] << 8) | packet[2];
+    size_t payload_len = ((size_t)packet[1] << 8) | packet[2];
     if (payload_len > MAX_HEARTBEAT) return -1;
     if (payload_len > packet_len - 3) return -1; // critical check
     if (payload_len > OUT_CAP) return -1;
     memcpy(out, packet + 3, payload_len);
-    return payload_len;
+    return (int)payload_len;
 }
 
-// Entry point that wires heartbeat and chat together for a session.
-int handle_packet(ClientSession *s, const uint8_t *packet, size_t len, uint8_t *outbuf) {
-    if (len == 0) return -1;
+// Branch-light equivalent of process_heartbeat_hardened used on the packet path.
+// MAX_HEARTBEAT cannot be exceeded by a 16-bit length, and the packet and
+// output bounds fold into a single compare against their minimum (a cmov).
+int process_heartbeat_checked(const uint8_t *packet, size_t packet_len, uint8_t *out) {
+    if (packet_len < 3) return -1;
+    size_t payload_len = ((size_t)packet[1] << 8) | packet[2];
+    size_t avail = packet_len - 3;
+    size_t limit = avail < OUT_CAP ? avail : OUT_CAP;
+    if (payload_len > limit) return -1;
+    memcpy(out, packet + 3, payload_len);
+    return (int)payload_len;
+}
+
+// Size of the complete frame at the start of buf: 0 while more bytes are
+// needed, -1 for an unknown type or oversized heartbeat. The transport only
+// passes complete frames to handle_packet.
+int frame_length(const uint8_t *buf, size_t avail) {
+    if (avail < 1) return 0;
+    size_t need;
+    switch (buf[0]) {
+    case 0x01:
+        if (avail < 3) return 0;
+        need = 3 + (((size_t)buf[1] << 8) | buf[2]);
+        if (need > MAX_FRAME) return -1;
+        break;
+    case 0x02:
+    case 0x04:
+        if (avail < 2) return 0;
+        need = 2 + (size_t)buf[1];
+        break;
+    case 0x03: need = 1; break;
+    case 0x05: need = 9; break;
+    default: return -1;
+    }
+    return avail < need ? 0 : (int)need;
+}
+
+static int dispatch_packet(ClientSession *s, const uint8_t *packet, size_t len, uint8_t *outbuf) {
     uint8_t ptype = packet[0];
 
     switch (ptype) {
-    case 0x01: { // heartbeat
-        int copied = process_heartbeat(packet, len, outbuf);
+    case 0x01: { // heartbeat; a non-empty payload is echoed
+        uint64_t t0 = profile_begin();
+        int copied = process_heartbeat_checked(packet, len, outbuf + MSG_HEADER);
+        profile_end(STAGE_HEARTBEAT, t0);
         if (copied > 0) {
-            s->last_heartbeat_ms = now_ms();
             record_metric("hb_ok", 1);
-        } else {
-            record_metric("hb_err", 1);
+            return (int)msg_header(outbuf, MSG_ECHO, (size_t)copied);
         }
+        record_metric("hb_err", 1);
         return copied;
     }
     case 0x02: { // chat message
@@ -142,42 +773,151 @@ int handle_packet(ClientSession *s, const uint8_t *packet, size_t len, uint8_t *
         size_t msg_len = clamp_int(packet[1], 0, MAX_MSG);
         if (msg_len + 2 > len) return -1;
         process_chat_message(s, packet + 2, msg_len);
-        return (int)msg_len;
-    }
-    case 0x03: { // rotate key
-        rotate_session_key(s);
         return 0;
     }
+    case 0x03: { // rotate key (asynchronous; completes in run_key_rotations)
+        return rotate_session_key(s);
+    }
+    case 0x04: { // auth: type(1) + len(1) + token
+        if (len < 2) return -1;
+        size_t tok_len = packet[1];
+        if (tok_len == 0 || tok_len >= MAX_TOKEN || tok_len + 2 > len) return -1;
+        char token[MAX_TOKEN];
+        memcpy(token, packet + 2, tok_len);
+        token[tok_len] = '\0';
+        return authenticate_deferred(s, token) < 0 ? -1 : 0;
+    }
+    case 0x05: { // resume: type(1) + ticket(8); ticket 0 asks for the current one
+        if (len < 9) return -1;
+        uint64_t ticket = 0;
+        for (int i = 0; i < 8; i++) ticket = (ticket << 8) | packet[1 + i];
+        if (ticket && resume_session(s, ticket) < 0) return -1;
+        if (!s->authenticated || !s->resume_ticket) return -1;
+        for (int i = 0; i < 8; i++) outbuf[MSG_HEADER + i] = (uint8_t)(s->resume_ticket >> (56 - 8 * i));
+        return (int)msg_header(outbuf, MSG_TICKET, 8);
+    }
     default:
-        record_metric("unknown_type", ptype);
+        record_metric("unknown_type", 1);
         return -1;
     }
 }
 
-// Periodic maintenance to drop stale sessions.
-void reap_idle_sessions(uint64_t idle_ms) {
+static struct {
+    uint64_t window_ms;   // 0 = off
+    int mode;             // HB_COALESCE_ACK or HB_COALESCE_SILENT
+} hb_coalesce;
+
+void set_heartbeat_coalescing(uint64_t window_ms, int mode) {
+    hb_coalesce.window_ms = window_ms;
+    hb_coalesce.mode = mode;
+}
+
+// A heartbeat arriving within the window after any valid frame proves nothing
+// new. It is validated like a full one but answered with a MSG_ACK carrying
+// the first payload byte, or not at all, instead of echoing the whole payload.
+static int coalesce_heartbeat(const uint8_t *packet, size_t len, uint8_t *outbuf) {
+    if (len < 3) return -1;
+    size_t payload_len = ((size_t)packet[1] << 8) | packet[2];
+    if (payload_len > len - 3 || payload_len > OUT_CAP) return -1;
+    record_metric("hb_coalesced", 1);
+    if (hb_coalesce.mode == HB_COALESCE_SILENT || payload_len == 0) {
+        record_metric("hb_echo_bytes_saved", (int)payload_len);
+        return 0;
+    }
+    record_metric("hb_echo_bytes_saved", (int)payload_len - 1);
+    outbuf[MSG_HEADER] = packet[3];
+    return (int)msg_header(outbuf, MSG_ACK, 1);
+}
+
+// Entry point that wires heartbeat and chat together for a session. The
+// reply, if any, is one complete server message (heartbeat.h) written to
+// outbuf, which holds MAX_REPLY bytes; returns its size, 0 for no reply, or
+// -1 for a rejected frame.
+int handle_packet(ClientSession *s, const uint8_t *packet, size_t len, uint8_t *outbuf) {
+    if (len == 0) return -1;
+    GW_PROBE3(packet__received, s->id, packet[0], len);
+    uint64_t t = now_ms();
+    int rc;
+    if (hb_coalesce.window_ms && packet[0] == 0x01 && s->last_heartbeat_ms &&
+        t - s->last_heartbeat_ms < hb_coalesce.window_ms) {
+        rc = coalesce_heartbeat(packet, len, outbuf);
+    } else {
+        rc = dispatch_packet(s, packet, len, outbuf);
+    }
+    // Every valid frame is liveness, for the reaper and the keepalive prober
+    // alike; this is the only place it is recorded.
+    if (rc >= 0) s->last_heartbeat_ms = t;
+    GW_PROBE3(packet__dispatched, s->id, packet[0], rc);
+    return rc;
+}
+
+static int reap_trusts_sockets;
+
+// With kernel keepalive on every client socket, a connected, authenticated
+// session is live until its socket fails (ETIMEDOUT on read), so the reaper
+// leaves it alone and its client may heartbeat less often than the idle
+// threshold. A live socket says nothing about a client that never logged in,
+// so those are still reaped once idle.
+void set_reap_trusts_sockets(int enabled) {
+    reap_trusts_sockets = enabled;
+}
+
+// Periodic maintenance to drop stale sessions. A reaped session is logged out
+// with its heartbeat time cleared, so it is reaped once; the transport closes
+// its connection. Returns how many were reaped.
+int reap_idle_sessions(uint64_t idle_ms) {
     uint64_t t = now_ms();
+    int reaped = 0;
     for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (reap_trusts_sockets && sessions[i].fd >= 0 && sessions[i].authenticated) continue;
         if (sessions[i].last_heartbeat_ms && t - sessions[i].last_heartbeat_ms > idle_ms) {
+            GW_PROBE2(session__expired, sessions[i].id, t - sessions[i].last_heartbeat_ms);
             log_warn("session idle", sessions[i].id);
+            spill_inbox(&sessions[i]);
+            if (sessions[i].authenticated && sessions[i].resume_ticket) {
+                park_session(&sessions[i], t);
+                sessions[i].resume_ticket = 0;
+            }
             sessions[i].authenticated = 0;
-            sessions[i].inbox_len = 0;
+            clear_inbox(&sessions[i]);
+            sessions[i].last_heartbeat_ms = 0;
+            reaped++;
         }
     }
+    return reaped;
 }
 
 // Simple test harness (invoked from main.c)
 int run_gateway_demo(void) {
-    init_sessions();
+    if (open_session_store(getenv("GATEWAY_SESSION_STORE")) != 1) init_sessions();
     ClientSession *s = &sessions[0];
 
     // Fake authenticate
     authenticate(s, "ABC123");
 
     uint8_t packet[8];
-    uint8_t out[OUT_CAP];
+    uint8_t out[MAX_REPLY];
+
+    // Key rotation is queued by the packet and completed by the rotation pass.
+    uint8_t rotate = 0x03;
+    handle_packet(s, &rotate, 1, out);
+    printf("key rotations completed: %d\n", run_key_rotations(ROTATE_QUEUE_CAP));
+
+    // Login frames queue for batched verification; the repeat is verified once.
+    uint8_t login[2 + 6] = { 0x04, 6, 'A', 'B', 'C', '4', '5', '6' };
+    handle_packet(&sessions[1], login, sizeof(login), out);
+    handle_packet(&sessions[2], login, sizeof(login), out);
+    printf("auth batch verified: %d\n", flush_auth_batch());
+
+    // Reap session 1 and resume it on session 3 with its ticket.
+    uint8_t resume[9] = { 0x05 };
+    handle_packet(&sessions[1], resume, sizeof(resume), out);
+    memcpy(resume + 1, out + MSG_HEADER, 8);
+    sessions[1].last_heartbeat_ms = 1;
+    reap_idle_sessions(0);
+    printf("resume on new session: %d\n", handle_packet(&sessions[3], resume, sizeof(resume), out));
 
-    // Craft a heartbeat: declares a larger payload than present.
+    // Craft a heartbeat: declares a larger payload than present (rejected).
     packet[0] = 0x01;
     packet[1] = 0x40; // high byte
     packet[2] = 0x00; // low byte
@@ -186,5 +926,6 @@ int run_gateway_demo(void) {
 
     int copied = handle_packet(s, packet, 5, out);
     printf("handle_packet copied: %d bytes\n", copied);
+    close_session_store();
     return copied;
 }
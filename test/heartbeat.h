@@ -0,0 +1,182 @@
+// Chat session gateway: shared session layout and entry points.
+
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 32   // override with -DMAX_CLIENTS to size the session table
+#endif
+#define MAX_MSG     2048
+#define MAX_HEARTBEAT 65535
+#define OUT_CAP     4096
+#define KEY_LEN     32
+#define MAX_TOKEN   64
+#define MAX_FRAME   (3 + OUT_CAP)   // largest frame frame_length() accepts
+#define IDLE_MS     30000           // reap_idle_sessions threshold used by the server
+
+// Smallest power of two >= n (n >= 1, up to 2^31), as a constant expression
+// for sizing masked tables from MAX_CLIENTS.
+#define POW2_SMEAR1(x) ((x) | (x) >> 1)
+#define POW2_SMEAR2(x) (POW2_SMEAR1(x) | POW2_SMEAR1(x) >> 2)
+#define POW2_SMEAR4(x) (POW2_SMEAR2(x) | POW2_SMEAR2(x) >> 4)
+#define POW2_SMEAR8(x) (POW2_SMEAR4(x) | POW2_SMEAR4(x) >> 8)
+#define POW2_CEIL(n)   ((POW2_SMEAR8((uint32_t)(n) - 1) | POW2_SMEAR8((uint32_t)(n) - 1) >> 16) + 1)
+
+// Wire protocol.
+// Client -> server frames (frame_length() sizes them):
+//   0x01 heartbeat  len(2, big-endian) + payload
+//   0x02 chat       len(1) + message
+//   0x03 rotate key
+//   0x04 auth       len(1) + token
+//   0x05 resume     ticket(8, big-endian); ticket 0 asks for the current one
+// Server -> client messages all share one header, type(1) + len(2,
+// big-endian), followed by len payload bytes, so a client can split the
+// stream without knowing what it asked for:
+#define MSG_HEADER   3
+#define MSG_ECHO     0x01   // heartbeat payload, echoed
+#define MSG_CHAT     0x02   // chat bytes delivered from the offline backlog
+#define MSG_TICKET   0x05   // resume ticket(8, big-endian), answering 0x05
+#define MSG_OVERLOAD 0x06   // reason(1), sent before refusing work:
+#define OVERLOAD_CONNECTION 0x01   //   connection closed right after
+#define OVERLOAD_CHAT       0x02   //   chat frame dropped, session kept
+#define OVERLOAD_RATE       0x03   //   source address over its admission rate
+#define MSG_PROBE    0x07   // send time(8); answer with a heartbeat carrying it
+#define MSG_ACK      0x08   // first payload byte of a coalesced heartbeat
+#define MAX_REPLY    (MSG_HEADER + OUT_CAP)   // largest message handle_packet() writes
+
+// Writes the header of a len-byte message of type; returns the message size.
+static inline size_t msg_header(uint8_t *out, uint8_t type, size_t len) {
+    out[0] = type;
+    out[1] = (uint8_t)(len >> 8);
+    out[2] = (uint8_t)len;
+    return MSG_HEADER + len;
+}
+
+typedef struct {
+    int id;
+    int authenticated;
+    uint64_t last_heartbeat_ms;
+    char user[64];
+    uint8_t inbox[MAX_MSG];
+    size_t inbox_len;
+    uint8_t keys[2][KEY_LEN];      // active slot is key_epoch & 1; a rotation writes the other, then flips
+    _Atomic uint32_t key_epoch;
+    _Atomic int rotation_pending;
+    uint64_t resume_ticket;        // issued on auth, 0 = none
+    int fd;                        // client socket, -1 when not connected
+} ClientSession;
+
+// Capture file header (capture.c writes, replay.c reads).
+#define CAPTURE_MAGIC   0x47574350u   // "GWCP"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_clients;
+    uint32_t reserved;
+} CaptureHeader;
+
+// Memory region from huge_map (hugemem.c).
+enum { HUGE_NONE, HUGE_THP, HUGE_HUGETLB };
+
+typedef struct {
+    void *p;
+    size_t len;
+    int kind;    // HUGE_*
+} HugeRegion;
+
+// Heartbeat coalescing modes (set_heartbeat_coalescing).
+#define HB_COALESCE_ACK    1   // redundant heartbeats get a MSG_ACK
+#define HB_COALESCE_SILENT 2   // redundant heartbeats get no reply
+
+uint64_t now_ms(void);
+void log_info(const char *msg, int sid);
+void log_warn(const char *msg, int sid);
+void record_metric(const char *name, int value);
+void set_log_enabled(int enabled);
+
+int huge_map(HugeRegion *r, size_t bytes, const char *what);
+void huge_advise(void *p, size_t len);
+void huge_unmap(HugeRegion *r);
+
+void init_sessions(void);
+int place_session_table(void);
+ClientSession *session_by_id(int id);
+int open_session_store(const char *path);
+int adopt_session_store(const char *path);
+void close_session_store(void);
+void reset_session(ClientSession *s);
+void disconnect_session(ClientSession *s);
+int restore_inbox(const char *user, uint64_t ticket, const uint8_t *buf, size_t len);
+
+int enqueue_message(ClientSession *s, const uint8_t *buf, size_t len);
+int frame_length(const uint8_t *buf, size_t avail);
+int process_heartbeat(const uint8_t *packet, size_t packet_len, uint8_t *out);
+int process_heartbeat_hardened(const uint8_t *packet, size_t packet_len, uint8_t *out);
+int process_heartbeat_checked(const uint8_t *packet, size_t packet_len, uint8_t *out);
+int handle_packet(ClientSession *s, const uint8_t *packet, size_t len, uint8_t *outbuf);
+void set_heartbeat_coalescing(uint64_t window_ms, int mode);
+int run_key_rotations(int max);
+int flush_auth_batch(void);
+void set_reap_trusts_sockets(int enabled);
+int reap_idle_sessions(uint64_t idle_ms);
+
+void wal_configure(const char *dir, uint64_t sync_interval_us, uint64_t segment_bytes);
+int wal_replay(void);
+int wal_open(void);
+void wal_append(int sid, const uint8_t *payload, size_t len);
+void wal_clear(int sid);
+void wal_owner(int sid, const char *user, uint64_t ticket);
+int wal_pending(void);
+int wal_commit(int force);
+void wal_close(void);
+
+int offline_open(const char *dir);
+int offline_store(const char *user, const uint8_t *buf, size_t len);
+void offline_deliver(ClientSession *s);
+void offline_cancel(int sid);
+int offline_handoff(int sid, uint64_t *from);
+void offline_adopt(ClientSession *s, int state, uint64_t from);
+int offline_reindex(void);
+int offline_pending(int sid);
+int offline_streaming(int sid);
+void offline_flush(void);
+
+int metrics_serve(int port);
+void metrics_sample(void);
+void metrics_observe_frame(size_t bytes);
+void metrics_observe_loop(uint64_t ns);
+size_t metrics_render(char *buf, size_t cap);
+
+int udp_heartbeat_open(int port);
+int udp_heartbeat_fd(void);
+int udp_heartbeat_service(void);
+void udp_ticket_issued(int sid, uint64_t ticket);
+void udp_heartbeat_close(void);
+
+void keepalive_configure(uint64_t idle_ms);
+void keepalive_arm(int sid);
+void keepalive_disarm(int sid);
+int keepalive_activity(int sid, uint64_t t, const uint8_t *frame, size_t len);
+int keepalive_due(uint64_t t, int *sids, int max);
+
+enum { RATE_ACCEPT, RATE_AUTH, RATE_KIND_COUNT };   // per-source admission checks
+void ratelimit_configure(int kind, uint32_t per_sec, uint32_t burst);
+int ratelimit_admit(int kind, uint64_t key, uint64_t now);
+
+int capture_open(const char *path);
+void capture_frame(int sid, const uint8_t *frame, size_t len);
+void capture_flush(void);
+void capture_close(void);
+
+void set_tcp_keepalive(int enabled);
+int run_gateway_server(int port, const char *handoff_path);
+int run_gateway_takeover(const char *handoff_path, const char *store_path);
+int run_gateway_demo(void);
+
+#endif
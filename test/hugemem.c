@@ -0,0 +1,67 @@
+// Large-table placement: huge pages where the system allows, memory on the
+// NUMA node of the CPU running the event loop.
+//   1. MAP_HUGETLB with 2 MB pages (needs vm.nr_hugepages reserved);
+//   2. otherwise a normal mapping with MADV_HUGEPAGE so THP can back it;
+// then MPOL_PREFERRED for the local node, set before the first touch so the
+// pages are faulted in there. Regions are zero-filled like BSS.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+
+#define HUGE_PAGE      (2u * 1024 * 1024)
+#define MPOL_PREFERRED 1            // <numaif.h>, without the libnuma dependency
+
+static int local_node(void) {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) return -1;
+    return (int)node;
+}
+
+static void bind_local(void *p, size_t len, int node) {
+    if (node < 0 || node >= 64) return;
+    unsigned long mask = 1UL << node;
+    // Best effort: fails harmlessly on kernels without NUMA support.
+    syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+int huge_map(HugeRegion *r, size_t bytes, const char *what) {
+    int node = local_node();
+    // Explicit huge pages only when rounding up wastes less than half a page.
+    if (bytes >= HUGE_PAGE / 2) {
+        size_t len = (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+        if (p != MAP_FAILED) {
+            bind_local(p, len, node);
+            *r = (HugeRegion){ p, len, HUGE_HUGETLB };
+            printf("[info] %s: %zu KB on 2 MB pages, node %d\n", what, len / 1024, node);
+            return 0;
+        }
+    }
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    int kind = HUGE_NONE;
+    if (bytes >= HUGE_PAGE && madvise(p, bytes, MADV_HUGEPAGE) == 0) kind = HUGE_THP;
+    bind_local(p, bytes, node);
+    *r = (HugeRegion){ p, bytes, kind };
+    printf("[info] %s: %zu KB on %s pages, node %d\n", what, bytes / 1024,
+           kind == HUGE_THP ? "transparent huge" : "4 KB", node);
+    return 0;
+}
+
+// For mappings made elsewhere (the file-backed session store): THP hint and
+// local placement, both effective when the file lives on tmpfs.
+void huge_advise(void *p, size_t len) {
+    if (len >= HUGE_PAGE) madvise(p, len, MADV_HUGEPAGE);
+    bind_local(p, len, local_node());
+}
+
+void huge_unmap(HugeRegion *r) {
+    if (r->p) munmap(r->p, r->len);
+    *r = (HugeRegion){ 0 };
+}
@@ -0,0 +1,169 @@
+// Server-initiated keepalive probes.
+// A session that has been quiet for most of the idle threshold is sent a probe
+// (see gateway_server.c for the frame) early enough that the client's answer
+// lands before reap_idle_sessions would drop it. Per session:
+//   - the guard before the threshold is 4 x smoothed RTT (min KA_MIN_GUARD_MS),
+//     so slow links are probed earlier;
+//   - any inbound frame pushes the next check out, so active sessions are
+//     never probed;
+//   - a probe is answered only by a heartbeat echoing its send time, so the
+//     RTT sample is exact and ordinary heartbeats are never mistaken for it;
+//   - after KA_MAX_PROBES unanswered probes the session is left to the reaper,
+//     and probing starts over if it is heard from again;
+//   - each deadline is pulled in by a random jitter of up to 1/8 of the
+//     interval, so sessions that connected together do not probe together.
+// Deadlines live in a hashed timer wheel; rescheduling on activity is lazy
+// (the due check re-files sessions that saw traffic), so the per-frame cost
+// is a single store.
+
+#include <string.h>
+
+#include "heartbeat.h"
+
+#define KA_TICK_MS       100
+#define KA_SLOTS         1024      // power of two; ~100 s span
+#define KA_MIN_GUARD_MS  3000
+#define KA_MAX_PROBES    2         // first probe plus one retry
+#define KA_NONE          (-1)
+
+typedef struct {
+    uint64_t deadline_ms;
+    uint64_t sent_ms[KA_MAX_PROBES];   // send times carried by unanswered probes
+    uint32_t srtt_ms;     // 0 until the first answered probe
+    int probes;           // unanswered probes
+    int armed;            // connected; slot is KA_NONE once probes ran out
+    int next, prev, slot;
+} KeepaliveState;
+
+static KeepaliveState ka[MAX_CLIENTS];
+static int wheel[KA_SLOTS];
+static uint64_t ka_idle_ms;     // 0 = disabled
+static uint64_t ka_tick;        // next tick to walk
+static uint64_t ka_rng = 0x9e3779b97f4a7c15ULL;
+
+static void unlink_slot(int sid) {
+    KeepaliveState *k = &ka[sid];
+    if (k->slot == KA_NONE) return;
+    if (k->prev != KA_NONE) ka[k->prev].next = k->next;
+    else wheel[k->slot] = k->next;
+    if (k->next != KA_NONE) ka[k->next].prev = k->prev;
+    k->slot = KA_NONE;
+}
+
+static void schedule(int sid, uint64_t deadline_ms) {
+    KeepaliveState *k = &ka[sid];
+    unlink_slot(sid);
+    // Past deadlines go to the next tick: the current one may be mid-walk.
+    uint64_t tick = deadline_ms / KA_TICK_MS;
+    if (tick <= ka_tick) tick = ka_tick + 1;
+    k->deadline_ms = deadline_ms;
+    k->slot = (int)(tick & (KA_SLOTS - 1));
+    k->prev = KA_NONE;
+    k->next = wheel[k->slot];
+    if (k->next != KA_NONE) ka[k->next].prev = sid;
+    wheel[k->slot] = sid;
+}
+
+static uint64_t guard_ms(const KeepaliveState *k) {
+    uint64_t g = 4 * (uint64_t)k->srtt_ms;
+    if (g < KA_MIN_GUARD_MS) g = KA_MIN_GUARD_MS;
+    return g < ka_idle_ms / 2 ? g : ka_idle_ms / 2;
+}
+
+// The session's liveness time, shared with the reaper: the last valid frame
+// handle_packet() saw from it (or when it connected).
+static uint64_t last_heard(int sid) {
+    return session_by_id(sid)->last_heartbeat_ms;
+}
+
+// When a session should get its first probe, counting from when it was last heard.
+static uint64_t probe_deadline(int sid) {
+    uint64_t interval = ka_idle_ms - guard_ms(&ka[sid]);
+    ka_rng ^= ka_rng << 13; ka_rng ^= ka_rng >> 7; ka_rng ^= ka_rng << 17;
+    return last_heard(sid) + interval - ka_rng % (interval / 8 + 1);
+}
+
+void keepalive_configure(uint64_t idle_ms) {
+    ka_idle_ms = idle_ms;
+    ka_tick = now_ms() / KA_TICK_MS;
+    for (int i = 0; i < KA_SLOTS; i++) wheel[i] = KA_NONE;
+    for (int i = 0; i < MAX_CLIENTS; i++) ka[i].slot = KA_NONE;
+}
+
+void keepalive_arm(int sid) {
+    if (!ka_idle_ms) return;
+    KeepaliveState *k = &ka[sid];
+    unlink_slot(sid);
+    memset(k, 0, sizeof(*k));
+    k->slot = KA_NONE;
+    k->armed = 1;
+    schedule(sid, probe_deadline(sid));
+}
+
+void keepalive_disarm(int sid) {
+    if (!ka_idle_ms) return;
+    unlink_slot(sid);
+    ka[sid].armed = 0;
+}
+
+// Send time echoed by frame if it is the answer to one of k's probes, else 0.
+static uint64_t probe_echo(const KeepaliveState *k, const uint8_t *frame, size_t len) {
+    if (len != 3 + 8 || frame[0] != 0x01 || frame[1] != 0 || frame[2] != 8) return 0;
+    uint64_t stamp = 0;
+    for (int i = 0; i < 8; i++) stamp = (stamp << 8) | frame[3 + i];
+    for (int i = 0; i < k->probes; i++) {
+        if (k->sent_ms[i] == stamp) return stamp;
+    }
+    return 0;
+}
+
+// Records an inbound frame that handle_packet() accepted (and so already
+// counted as liveness). Returns 1 when it answers an outstanding probe.
+int keepalive_activity(int sid, uint64_t t, const uint8_t *frame, size_t len) {
+    if (!ka_idle_ms) return 0;
+    KeepaliveState *k = &ka[sid];
+    uint64_t stamp = k->probes ? probe_echo(k, frame, len) : 0;
+    if (stamp) {
+        uint32_t sample = (uint32_t)(t - stamp);
+        k->srtt_ms = k->srtt_ms ? (7 * k->srtt_ms + sample) / 8 : sample;
+        k->probes = 0;
+        record_metric("keepalive_answered", 1);
+    }
+    if (k->armed && k->slot == KA_NONE) {
+        k->probes = 0;                      // probes ran out; it is back
+        schedule(sid, probe_deadline(sid));
+    }
+    return stamp != 0;
+}
+
+// Fills sids with sessions to probe now and marks the probes as sent.
+// Returns the count; stops early (resuming next call) once max is reached.
+int keepalive_due(uint64_t t, int *sids, int max) {
+    if (!ka_idle_ms) return 0;
+    int n = 0;
+    // Only whole elapsed ticks are walked, so everything filed in one is due.
+    uint64_t end = t / KA_TICK_MS;
+    if (end > ka_tick + KA_SLOTS) ka_tick = end - KA_SLOTS;   // after a long stall
+    for (; ka_tick < end; ka_tick++) {
+        int sid = wheel[ka_tick & (KA_SLOTS - 1)];
+        while (sid != KA_NONE) {
+            KeepaliveState *k = &ka[sid];
+            int next = k->next;
+            if (k->deadline_ms > t) {
+                // A later lap of the wheel; leave it for then.
+            } else if (!k->probes && last_heard(sid) + ka_idle_ms - guard_ms(k) > t) {
+                schedule(sid, probe_deadline(sid));   // traffic since it was filed
+            } else if (k->probes >= KA_MAX_PROBES) {
+                unlink_slot(sid);                   // the reaper takes it from here
+            } else if (n == max) {
+                return n;
+            } else {
+                k->sent_ms[k->probes++] = t;   // the probe frame carries t
+                schedule(sid, t + guard_ms(k) / 2);
+                sids[n++] = sid;
+            }
+            sid = next;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,291 @@
+// Closed-loop load generator and soak tool for the gateway.
+// Opens many loopback connections, authenticates each, then sends a weighted
+// mix of heartbeat, chat and rotate-key frames at a target aggregate rate.
+// Each connection keeps at most one heartbeat outstanding; its echo round
+// trip is the latency sample. Prints one JSON summary line.
+//
+// build: cmake target loadgen (see CMakeLists.txt)
+// usage: loadgen [--port N] [--conns N] [--threads N] [--secs N] [--rate FRAMES_PER_SEC]
+//                [--mix HB:CHAT:ROT] [--payload BYTES] [--token TOKEN]
+// The gateway must be built with MAX_CLIENTS >= --conns.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS   64
+#define HIST_BUCKETS  (64 * 16)   // log2 major x 16 linear minor buckets, in ns
+#define SETTLE_MS     300         // let batched auth complete before measuring
+
+typedef struct {
+    int fd;
+    uint64_t next_send_ns;
+    uint64_t hb_sent_ns;       // 0 = no heartbeat outstanding
+    size_t echo_pending;       // bytes of the outstanding echo still to arrive
+} Conn;
+
+typedef struct {
+    pthread_t tid;
+    int nconns;
+    Conn *conns;
+    uint64_t rng;
+    uint64_t sent[3];
+    uint64_t echoes;
+    uint64_t stalls;           // heartbeat due while the previous one was unanswered
+    uint64_t errors;
+    uint64_t hist[HIST_BUCKETS];
+} Worker;
+
+static struct {
+    int port;
+    int conns;
+    int threads;
+    int secs;
+    double rate;
+    unsigned mix[3];
+    int payload;
+    const char *token;
+} cfg = { 7000, 1000, 4, 10, 20000, { 80, 18, 2 }, 64, "ALOADGEN" };
+
+static uint64_t measure_start_ns;
+static uint64_t measure_end_ns;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns < 16) return (int)ns;
+    int major = 63 - __builtin_clzll(ns);
+    int minor = (int)((ns >> (major - 4)) & 15);
+    return (major - 3) * 16 + minor;
+}
+
+static uint64_t bucket_floor(int b) {
+    if (b < 16) return (uint64_t)b;
+    int major = b / 16 + 3, minor = b % 16;
+    return (16ULL + (uint64_t)minor) << (major - 4);
+}
+
+static int open_conn(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)cfg.port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    uint8_t auth[2 + 255];
+    size_t tlen = strlen(cfg.token);
+    auth[0] = 0x04;
+    auth[1] = (uint8_t)tlen;
+    memcpy(auth + 2, cfg.token, tlen);
+    if (send(fd, auth, 2 + tlen, MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void send_frame(Worker *w, Conn *c, uint64_t t) {
+    static uint8_t payload[4096];
+    uint8_t frame[3 + sizeof(payload)];
+    unsigned total = cfg.mix[0] + cfg.mix[1] + cfg.mix[2];
+    unsigned pick = (unsigned)(next_rand(&w->rng) % total);
+    int type = pick < cfg.mix[0] ? 0 : pick < cfg.mix[0] + cfg.mix[1] ? 1 : 2;
+    size_t len;
+
+    if (type == 0 && c->hb_sent_ns) {
+        w->stalls++;
+        return;
+    }
+    if (type == 0) {
+        frame[0] = 0x01;
+        frame[1] = (uint8_t)(cfg.payload >> 8);
+        frame[2] = (uint8_t)cfg.payload;
+        memcpy(frame + 3, payload, (size_t)cfg.payload);
+        len = 3 + (size_t)cfg.payload;
+    } else if (type == 1) {
+        size_t n = cfg.payload > 255 ? 255 : (size_t)cfg.payload;
+        frame[0] = 0x02;
+        frame[1] = (uint8_t)n;
+        memcpy(frame + 2, payload, n);
+        len = 2 + n;
+    } else {
+        frame[0] = 0x03;
+        len = 1;
+    }
+    if (send(c->fd, frame, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)len) {
+        w->errors++;
+        return;
+    }
+    if (type == 0) {
+        c->hb_sent_ns = t;
+        c->echo_pending = 3 + (size_t)cfg.payload;   // MSG_ECHO header + payload
+    }
+    if (t >= measure_start_ns && t < measure_end_ns) w->sent[type]++;
+}
+
+static void read_echo(Worker *w, Conn *c) {
+    uint8_t buf[8192];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) w->errors++;
+        return;
+    }
+    if (!c->hb_sent_ns) return;
+    c->echo_pending = (size_t)n >= c->echo_pending ? 0 : c->echo_pending - (size_t)n;
+    if (c->echo_pending) return;
+    uint64_t t = mono_ns();
+    if (c->hb_sent_ns >= measure_start_ns && t < measure_end_ns) {
+        w->hist[hist_bucket(t - c->hb_sent_ns)]++;
+        w->echoes++;
+    }
+    c->hb_sent_ns = 0;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    int ep = epoll_create1(0);
+    for (int i = 0; i < w->nconns; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        epoll_ctl(ep, EPOLL_CTL_ADD, w->conns[i].fd, &ev);
+    }
+    // Per-connection interval so the aggregate hits cfg.rate; starts are staggered.
+    uint64_t interval = (uint64_t)(1e9 * cfg.conns / cfg.rate);
+    uint64_t t0 = mono_ns();
+    for (int i = 0; i < w->nconns; i++) {
+        w->conns[i].next_send_ns = t0 + next_rand(&w->rng) % (interval ? interval : 1);
+    }
+
+    struct epoll_event events[256];
+    while (mono_ns() < measure_end_ns) {
+        int n = epoll_wait(ep, events, 256, 1);
+        for (int i = 0; i < n; i++) read_echo(w, &w->conns[events[i].data.u32]);
+        uint64_t t = mono_ns();
+        for (int i = 0; i < w->nconns; i++) {
+            Conn *c = &w->conns[i];
+            if (t - c->next_send_ns > 4 * interval && c->next_send_ns < t) c->next_send_ns = t;
+            while (c->next_send_ns <= t) {
+                send_frame(w, c, t);
+                c->next_send_ns += interval;
+            }
+        }
+    }
+    close(ep);
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p) {
+    uint64_t want = (uint64_t)(p * (double)total), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want) return bucket_floor(b);
+    }
+    return 0;
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *k = argv[i], *v = argv[i + 1];
+        if (strcmp(k, "--port") == 0) cfg.port = atoi(v);
+        else if (strcmp(k, "--conns") == 0) cfg.conns = atoi(v);
+        else if (strcmp(k, "--threads") == 0) cfg.threads = atoi(v);
+        else if (strcmp(k, "--secs") == 0) cfg.secs = atoi(v);
+        else if (strcmp(k, "--rate") == 0) cfg.rate = atof(v);
+        else if (strcmp(k, "--payload") == 0) cfg.payload = atoi(v);
+        else if (strcmp(k, "--token") == 0) cfg.token = v;
+        else if (strcmp(k, "--mix") == 0) sscanf(v, "%u:%u:%u", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2]);
+    }
+    if (cfg.threads < 1) cfg.threads = 1;
+    if (cfg.rate < 1) cfg.rate = 1;
+    if (cfg.threads > MAX_THREADS) cfg.threads = MAX_THREADS;
+    if (cfg.payload < 1) cfg.payload = 1;        // an empty heartbeat has no echo to time
+    if (cfg.payload > 4096) cfg.payload = 4096;
+    if (strlen(cfg.token) > 63) cfg.token = "ALOADGEN";
+    if (cfg.mix[0] + cfg.mix[1] + cfg.mix[2] == 0) cfg.mix[0] = 1;
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)cfg.conns + 64) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)cfg.conns + 64 ? rl.rlim_max : (rlim_t)cfg.conns + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    static Worker workers[MAX_THREADS];
+    Conn *conns = calloc((size_t)cfg.conns, sizeof(Conn));
+    int opened = 0;
+    for (; opened < cfg.conns; opened++) {
+        conns[opened].fd = open_conn();
+        if (conns[opened].fd < 0) break;
+    }
+    if (opened < cfg.conns) fprintf(stderr, "only %d of %d connections opened\n", opened, cfg.conns);
+    if (opened == 0) return 1;
+    cfg.conns = opened;
+
+    uint64_t t = mono_ns();
+    measure_start_ns = t + (uint64_t)SETTLE_MS * 1000000;
+    measure_end_ns = measure_start_ns + (uint64_t)cfg.secs * 1000000000ULL;
+    int per = (opened + cfg.threads - 1) / cfg.threads;
+    for (int i = 0; i < cfg.threads; i++) {
+        Worker *w = &workers[i];
+        w->conns = conns + i * per;
+        w->nconns = opened - i * per < per ? opened - i * per : per;
+        if (w->nconns < 0) w->nconns = 0;
+        w->rng = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        pthread_create(&w->tid, NULL, worker_main, w);
+    }
+
+    static uint64_t hist[HIST_BUCKETS];
+    uint64_t sent[3] = { 0 }, echoes = 0, stalls = 0, errors = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        Worker *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        for (int k = 0; k < 3; k++) sent[k] += w->sent[k];
+        for (int b = 0; b < HIST_BUCKETS; b++) hist[b] += w->hist[b];
+        echoes += w->echoes;
+        stalls += w->stalls;
+        errors += w->errors;
+    }
+    for (int i = 0; i < opened; i++) close(conns[i].fd);
+    free(conns);
+
+    double secs = (double)cfg.secs;
+    printf("{\"conns\":%d,\"threads\":%d,\"secs\":%d,\"target_rate\":%.0f,\"payload\":%d,"
+           "\"sent_per_sec\":%.0f,\"heartbeat_per_sec\":%.0f,\"chat_per_sec\":%.0f,\"rotate_per_sec\":%.0f,"
+           "\"echoes\":%llu,\"stalls\":%llu,\"errors\":%llu,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+           cfg.conns, cfg.threads, cfg.secs, cfg.rate, cfg.payload,
+           (double)(sent[0] + sent[1] + sent[2]) / secs,
+           (double)sent[0] / secs, (double)sent[1] / secs, (double)sent[2] / secs,
+           (unsigned long long)echoes, (unsigned long long)stalls, (unsigned long long)errors,
+           percentile(hist, echoes, 0.50) / 1e3, percentile(hist, echoes, 0.90) / 1e3,
+           percentile(hist, echoes, 0.99) / 1e3, percentile(hist, echoes, 0.999) / 1e3);
+    return 0;
+}
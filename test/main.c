@@ -1,8 +1,70 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-int run_gateway_demo(void);
+#include "heartbeat.h"
+#include "memacct.h"
+#include "outq.h"
+#include "profile.h"
 
-int main(void) {
+int main(int argc, char **argv) {
+    if (argc > 1) place_session_table();
+    // A successor maps the session store only once the handoff is done: its
+    // predecessor serves from that file until then.
+    int takeover = argc > 2 && strcmp(argv[1], "takeover") == 0;
+    if (argc > 1 && (takeover || open_session_store(getenv("GATEWAY_SESSION_STORE")) != 1)) init_sessions();
+    const char *wal_dir = getenv("GATEWAY_WAL_DIR");
+    if (wal_dir) {
+        const char *sync_us = getenv("GATEWAY_WAL_SYNC_US");
+        const char *segment_bytes = getenv("GATEWAY_WAL_SEGMENT_BYTES");
+        wal_configure(wal_dir, sync_us ? strtoull(sync_us, NULL, 10) : 1000,
+                      segment_bytes ? strtoull(segment_bytes, NULL, 10) : 0);
+    }
+    const char *offline_dir = getenv("GATEWAY_OFFLINE_DIR");
+    if (argc > 1 && offline_dir && offline_open(offline_dir) < 0) return 1;
+    const char *capture_path = getenv("GATEWAY_CAPTURE");
+    if (argc > 1 && capture_path && capture_open(capture_path) < 0) return 1;
+    const char *metrics_port = getenv("GATEWAY_METRICS_PORT");
+    if (argc > 1 && metrics_port && metrics_serve(atoi(metrics_port)) < 0) return 1;
+    const char *udp_port = getenv("GATEWAY_UDP_PORT");
+    if (argc > 1 && udp_port && udp_heartbeat_open(atoi(udp_port)) < 0) return 1;
+    const char *coalesce_ms = getenv("GATEWAY_HB_COALESCE_MS");
+    if (argc > 1 && coalesce_ms) {
+        const char *mode = getenv("GATEWAY_HB_COALESCE_MODE");
+        set_heartbeat_coalescing(strtoull(coalesce_ms, NULL, 10),
+                                 mode && strcmp(mode, "silent") == 0 ? HB_COALESCE_SILENT : HB_COALESCE_ACK);
+    }
+    if (argc > 1 && getenv("GATEWAY_SERVER_PROBES")) keepalive_configure(IDLE_MS);
+    if (argc > 1 && getenv("GATEWAY_TCP_KEEPALIVE")) set_tcp_keepalive(1);
+    const char *outq_soft = getenv("GATEWAY_OUTQ_SOFT"), *outq_hard = getenv("GATEWAY_OUTQ_HARD");
+    const char *outq_policy = getenv("GATEWAY_OUTQ_POLICY");
+    if (argc > 1 && (outq_soft || outq_hard || outq_policy)) {
+        int policy = OUTQ_DISCONNECT;
+        if (outq_policy && strcmp(outq_policy, "drop-oldest") == 0) policy = OUTQ_DROP_OLDEST;
+        if (outq_policy && strcmp(outq_policy, "drop-newest") == 0) policy = OUTQ_DROP_NEWEST;
+        outq_set_limits(outq_soft ? strtoull(outq_soft, NULL, 10) : 64 * 1024,
+                        outq_hard ? strtoull(outq_hard, NULL, 10) : 1024 * 1024, policy);
+    }
+    const char *mem_budget = getenv("GATEWAY_MEM_BUDGET");
+    if (argc > 1 && mem_budget) mem_set_budget(strtoull(mem_budget, NULL, 10));
+    const char *accept_rate = getenv("GATEWAY_ACCEPT_RATE"), *accept_burst = getenv("GATEWAY_ACCEPT_BURST");
+    if (argc > 1 && accept_rate) {
+        ratelimit_configure(RATE_ACCEPT, (uint32_t)atoi(accept_rate), accept_burst ? (uint32_t)atoi(accept_burst) : 0);
+    }
+    const char *auth_rate = getenv("GATEWAY_AUTH_RATE"), *auth_burst = getenv("GATEWAY_AUTH_BURST");
+    if (argc > 1 && auth_rate) {
+        ratelimit_configure(RATE_AUTH, (uint32_t)atoi(auth_rate), auth_burst ? (uint32_t)atoi(auth_burst) : 0);
+    }
+    const char *profile_ms = getenv("GATEWAY_PROFILE_MS");
+    if (argc > 1 && profile_ms) profile_enable(strtoull(profile_ms, NULL, 10));
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        int port = argc > 2 ? atoi(argv[2]) : 7000;
+        if (wal_replay() < 0 || wal_open() < 0) return 1;
+        return run_gateway_server(port, argc > 3 ? argv[3] : NULL) < 0;
+    }
+    if (takeover) {
+        return run_gateway_takeover(argv[2], getenv("GATEWAY_SESSION_STORE")) < 0;
+    }
     int copied = run_gateway_demo();
     printf("Gateway demo copied: %d bytes\n", copied);
     return 0;
@@ -0,0 +1,45 @@
+// Memory budget and overload state (see memacct.h). Only the event loop
+// charges and releases, so the counters are plain integers; metrics_sample
+// copies them for the scrape thread.
+
+#include <stdio.h>
+
+#include "heartbeat.h"
+#include "memacct.h"
+
+size_t mem_used[MEM_KIND_COUNT];
+size_t mem_total;
+
+static struct {
+    size_t budget;       // 0 = unlimited
+    size_t high, low;    // enter / leave overload
+    int overloaded;
+} mem;
+
+void mem_set_budget(size_t bytes) {
+    mem.budget = bytes;
+    mem.high = bytes - bytes / 8;
+    mem.low = bytes - bytes / 4;
+}
+
+// Recounts live inboxes after a takeover restored them without going
+// through enqueue_message.
+void mem_account_inboxes(void) {
+    size_t bytes = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) bytes += session_by_id(i)->inbox_len;
+    mem_release(MEM_INBOX, mem_used[MEM_INBOX]);
+    mem_charge(MEM_INBOX, bytes);
+}
+
+int mem_overloaded(void) {
+    if (!mem.budget) return 0;
+    if (!mem.overloaded && mem_total >= mem.high) {
+        mem.overloaded = 1;
+        record_metric("mem_overload", 1);
+        printf("[warn] memory budget: overloaded at %zu of %zu bytes\n", mem_total, mem.budget);
+    } else if (mem.overloaded && mem_total < mem.low) {
+        mem.overloaded = 0;
+        printf("[info] memory budget: recovered at %zu of %zu bytes\n", mem_total, mem.budget);
+    }
+    return mem.overloaded;
+}
@@ -0,0 +1,39 @@
+#ifndef MEMACCT_H
+#define MEMACCT_H
+
+// Gateway-wide accounting of memory that grows with load: live inbox bytes,
+// inbox copies held by parked sessions, output-queue backlogs and arena
+// overflow blocks. Fixed tables sized at startup are not counted. With a
+// budget set, the gateway turns overloaded at 7/8 of it and stops admitting
+// new connections and chat frames (answering with MSG_OVERLOAD, heartbeat.h)
+// until usage falls back under 3/4; heartbeats and draining continue
+// throughout.
+
+#include <stddef.h>
+
+typedef enum {
+    MEM_INBOX,       // bytes queued in live session inboxes
+    MEM_PARKED,      // inbox copies kept for resumable sessions
+    MEM_OUTQ,        // output-queue backlog buffers
+    MEM_ARENA,       // loop arena overflow blocks
+    MEM_KIND_COUNT
+} MemKind;
+
+extern size_t mem_used[MEM_KIND_COUNT];
+extern size_t mem_total;
+
+void mem_set_budget(size_t bytes);
+void mem_account_inboxes(void);
+int mem_overloaded(void);
+
+static inline void mem_charge(MemKind kind, size_t bytes) {
+    mem_used[kind] += bytes;
+    mem_total += bytes;
+}
+
+static inline void mem_release(MemKind kind, size_t bytes) {
+    mem_used[kind] -= bytes;
+    mem_total -= bytes;
+}
+
+#endif
@@ -0,0 +1,328 @@
+// Offline message store: inbox bytes of sessions that disconnect or get reaped
+// are appended, as ready-to-send MSG_CHAT messages, to a per-user segment file. A
+// reconnecting user's backlog is streamed straight from the page cache with
+// sendfile(), so the gateway never holds it in RAM.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+#include "outq.h"
+
+#define OFFLINE_MAGIC       0x47574f53u   // "GWOS"
+#define OFFLINE_VERSION     2
+#define OFFLINE_INDEX_SLOTS 256           // power of two
+
+// Segment header; frames follow. delivered_off is rewritten in place.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t delivered_off;
+} OfflineHeader;
+
+// Index from user to the undelivered byte range of their segment. Entries
+// are freed once drained; a freed slot stays a tombstone so lookups probing
+// past it still find the users filed after it.
+typedef struct {
+    char user[64];        // "" = free slot
+    int tombstone;        // freed slot inside a probe chain
+    uint64_t read_off;
+    uint64_t end_off;
+} OfflineEntry;
+
+static char offline_dir[256];
+static OfflineEntry offline_index[OFFLINE_INDEX_SLOTS];
+
+// Backlog transfers in progress, per session slot.
+static struct {
+    int slot;             // index entry, -1 = idle
+    int fd;
+    int started;          // bytes have gone out; the stream owns the socket
+    uint64_t start_off;   // read_off when the stream began, a frame boundary
+} delivering[MAX_CLIENTS];
+
+static void segment_path(char *out, size_t cap, const char *user) {
+    snprintf(out, cap, "%s/%s.seg", offline_dir, user);
+}
+
+// User names become file names, so anything but [A-Za-z0-9_-] is replaced.
+static void sanitize_user(char *out, const char *user) {
+    size_t i = 0;
+    for (; user[i] && i < 63; i++) {
+        char c = user[i];
+        int ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                 c == '-' || c == '_';
+        out[i] = ok ? c : '_';
+    }
+    out[i] = '\0';
+}
+
+static OfflineEntry *index_find(const char *user, int create) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = user; *p; p++) h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+    OfflineEntry *free_slot = NULL;
+    for (int i = 0; i < OFFLINE_INDEX_SLOTS; i++) {
+        OfflineEntry *e = &offline_index[(h + (uint64_t)i) & (OFFLINE_INDEX_SLOTS - 1)];
+        if (e->user[0]) {
+            if (strcmp(e->user, user) == 0) return e;
+            continue;
+        }
+        if (!free_slot) free_slot = e;
+        if (!e->tombstone) break;    // end of the probe chain
+    }
+    if (!create || !free_slot) return NULL;
+    snprintf(free_slot->user, sizeof(free_slot->user), "%s", user);
+    free_slot->tombstone = 0;
+    free_slot->read_off = free_slot->end_off = sizeof(OfflineHeader);
+    return free_slot;
+}
+
+static void index_release(OfflineEntry *e) {
+    memset(e, 0, sizeof(*e));
+    e->tombstone = 1;
+}
+
+// Records delivery progress in the segment header. A fully delivered segment
+// is unlinked rather than truncated: sendfile() may still reference its pages,
+// and truncation would zero them under the socket. Its index entry is freed.
+static void persist_read_off(OfflineEntry *e) {
+    char path[340];
+    segment_path(path, sizeof(path), e->user);
+    if (e->read_off == e->end_off) {
+        unlink(path);
+        index_release(e);
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    uint64_t off = e->read_off;
+    if (pwrite(fd, &off, sizeof(off), offsetof(OfflineHeader, delivered_off)) != sizeof(off)) {
+        printf("[warn] offline segment %s not updated\n", e->user);
+    }
+    close(fd);
+}
+
+static int is_segment(const struct dirent *d) {
+    size_t n = strlen(d->d_name);
+    return n > 4 && strcmp(d->d_name + n - 4, ".seg") == 0;
+}
+
+// Maps a segment read-only and walks its frames to find where valid data
+// ends; a torn final frame from a crash is truncated away.
+static void index_segment(const char *name) {
+    char user[64], path[340];
+    snprintf(user, sizeof(user), "%.*s", (int)(strlen(name) - 4), name);
+    segment_path(path, sizeof(path), user);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(OfflineHeader)) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    OfflineHeader hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    size_t end = sizeof(hdr), size = (size_t)st.st_size;
+    while (end + MSG_HEADER <= size && map[end] == MSG_CHAT &&
+           end + MSG_HEADER + (((size_t)map[end + 1] << 8) | map[end + 2]) <= size) {
+        end += MSG_HEADER + (((size_t)map[end + 1] << 8) | map[end + 2]);
+    }
+    munmap(map, size);
+    if (hdr.magic != OFFLINE_MAGIC || hdr.version != OFFLINE_VERSION ||
+        hdr.delivered_off < sizeof(hdr) || hdr.delivered_off > end) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+    if (end < size && ftruncate(fd, (off_t)end) < 0) end = size;
+    close(fd);
+    OfflineEntry *e = index_find(user, 1);
+    if (!e) return;
+    e->read_off = hdr.delivered_off;
+    e->end_off = end;
+}
+
+static int rebuild_index(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (offline_pending(i)) close(delivering[i].fd);
+        delivering[i].slot = -1;
+    }
+    memset(offline_index, 0, sizeof(offline_index));
+    mkdir(offline_dir, 0700);
+    struct dirent **names;
+    int n = scandir(offline_dir, &names, is_segment, alphasort);
+    if (n < 0) return -1;
+    for (int i = 0; i < n; i++) {
+        index_segment(names[i]->d_name);
+        free(names[i]);
+    }
+    free(names);
+    return n;
+}
+
+// Enables the store and rebuilds the index from the segments in dir. Calling
+// it again rebuilds from scratch; streams in progress are dropped.
+int offline_open(const char *dir) {
+    snprintf(offline_dir, sizeof(offline_dir), "%s", dir);
+    return rebuild_index();
+}
+
+// Rebuilds the index after another process changed the segments (a takeover
+// predecessor storing and delivering up to the handoff).
+int offline_reindex(void) {
+    return offline_dir[0] ? rebuild_index() : 0;
+}
+
+// Appends inbox bytes for user as chat frames. Returns -1 if the store is
+// disabled, the index is full or the write failed, in which case the caller
+// keeps the bytes.
+int offline_store(const char *user_name, const uint8_t *buf, size_t len) {
+    if (!offline_dir[0] || !user_name[0]) return -1;
+    char user[64], path[340];
+    sanitize_user(user, user_name);
+    OfflineEntry *e = index_find(user, 1);
+    if (!e) return -1;
+
+    // An inbox always fits one message.
+    uint8_t frames[MSG_HEADER + MAX_MSG];
+    if (len > MAX_MSG) len = MAX_MSG;
+    size_t flen = msg_header(frames, MSG_CHAT, len);
+    memcpy(frames + MSG_HEADER, buf, len);
+
+    segment_path(path, sizeof(path), user);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    struct stat st;
+    int rc = fstat(fd, &st);
+    if (rc == 0 && st.st_size == 0) {
+        OfflineHeader hdr = { OFFLINE_MAGIC, OFFLINE_VERSION, sizeof(OfflineHeader) };
+        rc = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) ? 0 : -1;
+        e->read_off = e->end_off = sizeof(hdr);
+    }
+    if (rc == 0) rc = write(fd, frames, flen) == (ssize_t)flen ? 0 : -1;
+    close(fd);
+    if (rc < 0) return -1;
+    e->end_off += flen;
+    record_metric("offline_stored_bytes", (int)len);
+    return 0;
+}
+
+// Schedules the backlog of the user s is authenticated as for streaming by
+// offline_flush(). A backlog streams to one connection at a time.
+void offline_deliver(ClientSession *s) {
+    if (!offline_dir[0] || s->fd < 0 || !s->authenticated || delivering[s->id].slot >= 0) return;
+    char user[64], path[340];
+    sanitize_user(user, s->user);
+    OfflineEntry *e = index_find(user, 0);
+    if (!e || e->read_off == e->end_off) return;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (delivering[i].slot == (int)(e - offline_index)) return;
+    }
+    segment_path(path, sizeof(path), user);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    delivering[s->id].slot = (int)(e - offline_index);
+    delivering[s->id].fd = fd;
+    delivering[s->id].started = 0;
+    delivering[s->id].start_off = e->read_off;
+}
+
+int offline_pending(int sid) {
+    return offline_dir[0] && delivering[sid].slot >= 0;
+}
+
+// True once part of the backlog is on the wire. Until then queued replies
+// (outq.c) go first; after that they wait for the stream to finish.
+int offline_streaming(int sid) {
+    return offline_pending(sid) && delivering[sid].started;
+}
+
+// Start of the frame holding byte off, found by walking frame headers from
+// a known boundary. A failed read stops at the last boundary reached.
+static uint64_t frame_start(int fd, uint64_t from, uint64_t off) {
+    uint8_t h[MSG_HEADER];
+    while (from < off && pread(fd, h, sizeof(h), (off_t)from) == (ssize_t)sizeof(h)) {
+        uint64_t next = from + MSG_HEADER + (((uint64_t)h[1] << 8) | h[2]);
+        if (next > off) break;
+        from = next;
+    }
+    return from;
+}
+
+// Ends a stream. One cut short resumes at the start of the frame it was in,
+// since the rest of that frame never reached the client.
+static void finish_delivery(int sid) {
+    OfflineEntry *e = &offline_index[delivering[sid].slot];
+    if (e->read_off != e->end_off) {
+        e->read_off = frame_start(delivering[sid].fd, delivering[sid].start_off, e->read_off);
+    }
+    close(delivering[sid].fd);
+    delivering[sid].slot = -1;
+    persist_read_off(e);
+}
+
+// Stops the stream of a session whose connection is going away.
+void offline_cancel(int sid) {
+    if (offline_pending(sid)) finish_delivery(sid);
+}
+
+// Detaches the stream of a session being handed to another process, with
+// progress persisted exactly (possibly mid-frame) for the successor's index.
+// Returns 0 if there was none, 1 if it had not started, 2 if it had; *from
+// gets the frame boundary it started at.
+int offline_handoff(int sid, uint64_t *from) {
+    if (!offline_pending(sid)) return 0;
+    int state = delivering[sid].started ? 2 : 1;
+    *from = delivering[sid].start_off;
+    close(delivering[sid].fd);
+    persist_read_off(&offline_index[delivering[sid].slot]);
+    delivering[sid].slot = -1;
+    return state;
+}
+
+// Continues a stream detached by offline_handoff() where it stopped.
+void offline_adopt(ClientSession *s, int state, uint64_t from) {
+    offline_deliver(s);
+    if (!offline_pending(s->id)) return;
+    delivering[s->id].started = state == 2;
+    delivering[s->id].start_off = from;
+}
+
+// Pushes as much backlog as each socket accepts; called once per loop iteration.
+void offline_flush(void) {
+    if (!offline_dir[0]) return;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (delivering[i].slot < 0) continue;
+        ClientSession *s = session_by_id(i);
+        OfflineEntry *e = &offline_index[delivering[i].slot];
+        if (s->fd < 0) {
+            finish_delivery(i);
+            continue;
+        }
+        if (!delivering[i].started && outq_backlog(i)) continue;
+        off_t off = (off_t)e->read_off;
+        ssize_t n = sendfile(s->fd, delivering[i].fd, &off, e->end_off - e->read_off);
+        if (n > 0) {
+            delivering[i].started = 1;
+            e->read_off = (uint64_t)off;
+            record_metric("offline_delivered_bytes", (int)n);
+        }
+        if (e->read_off == e->end_off || (n < 0 && errno != EAGAIN)) finish_delivery(i);
+    }
+}
@@ -0,0 +1,318 @@
+// Per-session output queues (see outq.h).
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "heartbeat.h"
+#include "memacct.h"
+#include "outq.h"
+
+#define OUTQ_IOV_INIT 8
+#define OUTQ_IOV_MAX  64     // per sendmsg; longer queues go out in MSG_MORE chunks
+#define OUTQ_KEEP     16384  // drained backlog buffers above this are freed
+
+typedef struct {
+    struct iovec *iov;       // this pass, arena-backed
+    int n, cap;
+    uint8_t *backlog;        // unsent bytes carried across passes, heap-backed
+    size_t boff, blen, bcap;
+    uint32_t *items;         // size of each reply in the backlog, oldest first
+    size_t ifirst, iend, icap;
+    size_t head_done;        // bytes of items[ifirst] already written
+    int head_partial;        // items[ifirst] was partly written before it was carried
+    int listed;              // on the dirty list
+    int state;               // OUTQ_*
+} OutQueue;
+
+static OutQueue outq[MAX_CLIENTS];
+static int dirty[MAX_CLIENTS];
+static int ndirty;
+
+static struct {
+    size_t soft, hard;
+    int policy;
+} limits = { 64 * 1024, 1024 * 1024, OUTQ_DISCONNECT };
+
+void outq_set_limits(size_t soft, size_t hard, int policy) {
+    limits.soft = soft;
+    limits.hard = hard > soft ? hard : soft;
+    limits.policy = policy;
+}
+
+static void list_dirty(OutQueue *q, int sid) {
+    if (q->listed) return;
+    q->listed = 1;
+    dirty[ndirty++] = sid;
+}
+
+static size_t pending(const OutQueue *q) {
+    return q->blen - q->boff;
+}
+
+// The head reply has bytes on the wire and can no longer be dropped.
+static int head_started(const OutQueue *q) {
+    return q->ifirst < q->iend && (q->head_done || q->head_partial);
+}
+
+static int push_item(OutQueue *q, size_t len) {
+    if (q->iend == q->icap && q->ifirst) {
+        memmove(q->items, q->items + q->ifirst, sizeof(*q->items) * (q->iend - q->ifirst));
+        q->iend -= q->ifirst;
+        q->ifirst = 0;
+    }
+    if (q->iend == q->icap) {
+        size_t cap = q->icap ? 2 * q->icap : 16;
+        uint32_t *v = realloc(q->items, sizeof(*v) * cap);
+        if (!v) return -1;
+        mem_charge(MEM_OUTQ, sizeof(*v) * (cap - q->icap));
+        q->items = v;
+        q->icap = cap;
+    }
+    q->items[q->iend++] = (uint32_t)len;
+    return 0;
+}
+
+static int backlog_append(OutQueue *q, const uint8_t *p, size_t len, int partial) {
+    if (q->boff) {
+        memmove(q->backlog, q->backlog + q->boff, q->blen - q->boff);
+        q->blen -= q->boff;
+        q->boff = 0;
+    }
+    if (q->blen + len > q->bcap) {
+        size_t cap = q->bcap ? q->bcap : 4096;
+        while (cap < q->blen + len) cap *= 2;
+        uint8_t *b = realloc(q->backlog, cap);
+        if (!b) return -1;
+        mem_charge(MEM_OUTQ, cap - q->bcap);
+        q->backlog = b;
+        q->bcap = cap;
+    }
+    if (push_item(q, len) < 0) return -1;
+    if (partial) q->head_partial = 1;   // only ever the first reply carried
+    memcpy(q->backlog + q->blen, p, len);
+    q->blen += len;
+    return 0;
+}
+
+static void free_buffers(OutQueue *q) {
+    mem_release(MEM_OUTQ, q->bcap + sizeof(*q->items) * q->icap);
+    free(q->backlog);
+    free(q->items);
+    q->backlog = NULL;
+    q->items = NULL;
+    q->boff = q->blen = q->bcap = 0;
+    q->ifirst = q->iend = q->icap = 0;
+    q->head_done = 0;
+    q->head_partial = 0;
+}
+
+// Marks c bytes at the front of the backlog as written.
+static void backlog_consume(OutQueue *q, size_t c) {
+    q->boff += c;
+    while (c && q->ifirst < q->iend) {
+        size_t rest = q->items[q->ifirst] - q->head_done;
+        if (c < rest) {
+            q->head_done += c;
+            break;
+        }
+        c -= rest;
+        q->ifirst++;
+        q->head_done = 0;
+        q->head_partial = 0;
+    }
+    if (q->boff == q->blen) {
+        q->boff = q->blen = q->ifirst = q->iend = 0;
+        if (q->bcap > OUTQ_KEEP) free_buffers(q);   // a burst is over; give it back
+    }
+}
+
+// Removes the oldest whole replies not yet started on the wire until the
+// backlog fits in limit; returns the bytes removed.
+static size_t drop_oldest(OutQueue *q, size_t limit) {
+    int started = head_started(q);
+    size_t first = q->ifirst + (size_t)started;
+    size_t pos = q->boff + (started ? q->items[q->ifirst] - q->head_done : 0);
+    size_t j = first, dropped = 0;
+    while (pending(q) - dropped > limit && j < q->iend) dropped += q->items[j++];
+    if (!dropped) return 0;
+    memmove(q->backlog + pos, q->backlog + pos + dropped, q->blen - pos - dropped);
+    q->blen -= dropped;
+    if (started) q->items[j - 1] = q->items[q->ifirst];   // the head slides over the gap
+    q->ifirst += j - first;
+    return dropped;
+}
+
+// Carries one reply (or the unsent tail of one) into the backlog, applying the
+// hard limit. Returns -1 when the session has to be disconnected.
+static int carry_item(OutQueue *q, const uint8_t *p, size_t len, int partial) {
+    if (!partial && pending(q) + len > limits.hard) {
+        if (limits.policy == OUTQ_DISCONNECT) {
+            record_metric("outq_hard_disconnect", 1);
+            return -1;
+        }
+        if (limits.policy == OUTQ_DROP_NEWEST) {
+            record_metric("outq_dropped_bytes", (int)len);
+            return 0;
+        }
+    }
+    if (backlog_append(q, p, len, partial) < 0) return -1;
+    if (limits.policy == OUTQ_DROP_OLDEST && pending(q) > limits.hard) {
+        record_metric("outq_dropped_bytes", (int)drop_oldest(q, limits.hard));
+    }
+    return 0;
+}
+
+void outq_push(Arena *a, int sid, const void *buf, size_t len) {
+    if (!len) return;
+    OutQueue *q = &outq[sid];
+    list_dirty(q, sid);
+    if (q->n == q->cap) {
+        int cap = q->cap ? 2 * q->cap : OUTQ_IOV_INIT;
+        struct iovec *v = arena_alloc(a, sizeof(*v) * (size_t)cap);
+        if (!v) {
+            if (carry_item(q, buf, len, 0) < 0) q->state = OUTQ_FAILED;
+            return;
+        }
+        if (q->n) memcpy(v, q->iov, sizeof(*v) * (size_t)q->n);
+        q->iov = v;
+        q->cap = cap;
+    }
+    q->iov[q->n++] = (struct iovec){ (void *)buf, len };
+}
+
+// Moves queued references from index i (skipping the first skip bytes) into
+// the backlog, since the memory behind them does not outlive the pass.
+static int carry_rest(OutQueue *q, int i, size_t skip) {
+    for (; i < q->n; i++, skip = 0) {
+        if (carry_item(q, (uint8_t *)q->iov[i].iov_base + skip, q->iov[i].iov_len - skip, skip > 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns OUTQ_IDLE when everything went out, OUTQ_BLOCKED when bytes remain.
+static int flush_one(OutQueue *q, int fd, int hold) {
+    int next = 0;
+    if (hold) goto carry;        // another writer owns the stream for now
+    while (pending(q) || next < q->n) {
+        struct iovec vec[OUTQ_IOV_MAX];
+        int k = 0, first = next;
+        size_t b = pending(q);
+        if (b) vec[k++] = (struct iovec){ q->backlog + q->boff, b };
+        while (k < OUTQ_IOV_MAX && next < q->n) vec[k++] = q->iov[next++];
+        struct msghdr m = { .msg_iov = vec, .msg_iovlen = (size_t)k };
+        ssize_t w = sendmsg(fd, &m, MSG_NOSIGNAL | MSG_DONTWAIT | (next < q->n ? MSG_MORE : 0));
+        record_metric("outq_sendmsg", 1);
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EINTR) return OUTQ_FAILED;
+            w = 0;
+        }
+        size_t left = (size_t)w;
+        if (b) {
+            size_t c = left < b ? left : b;
+            backlog_consume(q, c);
+            left -= c;
+            if (pending(q)) {
+                next = first;    // nothing past the backlog was written
+                goto carry;
+            }
+        }
+        int i = first;
+        while (i < next && left >= q->iov[i].iov_len) left -= q->iov[i++].iov_len;
+        if (i < next) {
+            if (carry_rest(q, i, left) < 0) return OUTQ_FAILED;
+            q->n = 0;
+            return OUTQ_BLOCKED;
+        }
+    }
+    q->n = 0;
+    return OUTQ_IDLE;
+carry:
+    if (carry_rest(q, next, 0) < 0) return OUTQ_FAILED;
+    q->n = 0;
+    return pending(q) ? OUTQ_BLOCKED : OUTQ_IDLE;
+}
+
+// Flushes every session queued this pass or still holding a backlog. Fills
+// changed with sessions whose state moved so the transport can close them or
+// adjust epoll interest; returns the count. A backlog above the soft limit
+// marks the session SLOW until it drains below half of it.
+int outq_flush_all(int *changed, int max) {
+    int carried = 0, nchanged = 0;
+    for (int d = 0; d < ndirty; d++) {
+        int sid = dirty[d];
+        OutQueue *q = &outq[sid];
+        ClientSession *s = session_by_id(sid);
+        q->listed = 0;
+        int prev = q->state, st;
+        if (s->fd < 0) {
+            outq_reset(sid);
+            continue;
+        }
+        if (prev == OUTQ_FAILED) {
+            st = OUTQ_FAILED;
+        } else {
+            // An offline backlog stream in progress must not be split by replies.
+            st = flush_one(q, s->fd, offline_streaming(sid));
+        }
+        if (st == OUTQ_BLOCKED &&
+            (pending(q) > limits.soft || (prev == OUTQ_SLOW && pending(q) > limits.soft / 2))) {
+            st = OUTQ_SLOW;
+            if (prev != OUTQ_SLOW) {
+                log_warn("slow consumer", sid);
+                record_metric("outq_slow_consumer", 1);
+            }
+        }
+        q->state = st;
+        q->iov = NULL;           // arena memory, gone after this pass
+        q->n = q->cap = 0;
+        if (st == OUTQ_BLOCKED || st == OUTQ_SLOW) {
+            q->listed = 1;
+            dirty[carried++] = sid;
+        }
+        if (st != prev && nchanged < max) changed[nchanged++] = sid;
+    }
+    ndirty = carried;
+    return nchanged;
+}
+
+int outq_state(int sid) {
+    return outq[sid].state;
+}
+
+size_t outq_backlog(int sid) {
+    return pending(&outq[sid]);
+}
+
+// Unsent backlog bytes of sid, for handing the session to another process.
+size_t outq_peek(int sid, const uint8_t **p) {
+    OutQueue *q = &outq[sid];
+    *p = q->backlog + q->boff;
+    return pending(q);
+}
+
+// Queues bytes another process had already accepted for sid (outq_peek on
+// its side). They go out ahead of anything queued later and, since they may
+// start mid-reply, are never dropped.
+int outq_adopt(int sid, const void *buf, size_t len) {
+    OutQueue *q = &outq[sid];
+    if (!len) return 0;
+    if (carry_item(q, buf, len, 1) < 0) return -1;
+    list_dirty(q, sid);
+    return 0;
+}
+
+// Drops everything queued for a closing session. It may stay on the dirty
+// list until the next flush, which then skips it.
+void outq_reset(int sid) {
+    OutQueue *q = &outq[sid];
+    free_buffers(q);
+    q->n = q->cap = 0;
+    q->iov = NULL;
+    q->state = OUTQ_IDLE;
+}
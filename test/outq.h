@@ -0,0 +1,35 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+// Per-session output queue. Replies produced during an event-loop pass are
+// queued as references (into the loop arena or other memory that outlives
+// the pass) and written once at the end of the pass with one sendmsg() per
+// session, so a read that produced many small replies costs one syscall and
+// usually one segment. Bytes the socket does not accept are copied into a
+// per-session backlog and retried first on later passes; the transport arms
+// EPOLLOUT while a backlog exists.
+//
+// A peer that stops reading is held to two limits on its backlog. Above the
+// soft limit the session is SLOW: the transport stops reading from it, so it
+// produces no new replies, until the backlog drains below half the limit.
+// Reaching the hard limit applies the configured policy: disconnect, or drop
+// whole unsent replies (oldest or newest) to stay under it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+enum { OUTQ_IDLE, OUTQ_BLOCKED, OUTQ_SLOW, OUTQ_FAILED };
+enum { OUTQ_DISCONNECT, OUTQ_DROP_OLDEST, OUTQ_DROP_NEWEST };
+
+void outq_set_limits(size_t soft, size_t hard, int policy);
+void outq_push(Arena *a, int sid, const void *buf, size_t len);
+int outq_flush_all(int *changed, int max);
+int outq_state(int sid);
+size_t outq_backlog(int sid);
+size_t outq_peek(int sid, const uint8_t **p);
+int outq_adopt(int sid, const void *buf, size_t len);
+void outq_reset(int sid);
+
+#endif
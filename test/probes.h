@@ -0,0 +1,31 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT tracepoints (provider "gateway"). Each probe is a single nop plus an
+// ELF note until a tracer attaches, e.g.
+//   bpftrace -e 'usdt:./gateway_demo:gateway:packet__dispatched { @[arg1] = count(); }'
+//   perf probe -x gateway_demo sdt_gateway:auth__fail
+//
+//   packet__received    (sid, type, len)
+//   packet__dispatched  (sid, type, rc)
+//   auth__ok            (sid)
+//   auth__fail          (sid)
+//   enqueue             (sid, len, inbox_len)
+//   enqueue__reject     (sid, len, inbox_len)
+//   session__expired    (sid, idle_ms)
+//
+// Built with GATEWAY_USDT=1 when <sys/sdt.h> (systemtap-sdt-dev) is available;
+// otherwise the macros compile to nothing.
+
+#if GATEWAY_USDT
+#include <sys/sdt.h>
+#define GW_PROBE1(name, a)       DTRACE_PROBE1(gateway, name, a)
+#define GW_PROBE2(name, a, b)    DTRACE_PROBE2(gateway, name, a, b)
+#define GW_PROBE3(name, a, b, c) DTRACE_PROBE3(gateway, name, a, b, c)
+#else
+#define GW_PROBE1(name, a)       do { (void)sizeof(a); } while (0)
+#define GW_PROBE2(name, a, b)    do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define GW_PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+// Stage profiler (see profile.h): accumulates ticks per stage and dumps one
+// JSON line per interval, e.g.
+//   {"profile_ms":1000,"stages":{"read":{"calls":812,"ns":90211,"ns_per_call":111.1,"pct":0.01},...}}
+// where pct is the share of the interval's wall time spent in the stage.
+
+#include <stdio.h>
+
+#include "heartbeat.h"
+#include "profile.h"
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "read", "decode", "dispatch", "heartbeat", "enqueue", "forward", "write",
+};
+
+int profile_enabled;
+
+static struct {
+    uint64_t every_ms;
+    uint64_t last_dump_ms;
+    double ns_per_tick;
+    uint64_t ticks[STAGE_COUNT];
+    uint64_t calls[STAGE_COUNT];
+} prof;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// The TSC rate is not exposed portably, so measure it against CLOCK_MONOTONIC.
+static double calibrate_ns_per_tick(void) {
+    uint64_t n0 = mono_ns(), t0 = profile_clock();
+    struct timespec nap = { 0, 20 * 1000000L };
+    nanosleep(&nap, NULL);
+    uint64_t dn = mono_ns() - n0, dt = profile_clock() - t0;
+    return dt ? (double)dn / (double)dt : 1.0;
+}
+
+void profile_enable(uint64_t dump_every_ms) {
+    prof.every_ms = dump_every_ms ? dump_every_ms : 1000;
+    prof.ns_per_tick = calibrate_ns_per_tick();
+    prof.last_dump_ms = now_ms();
+    profile_enabled = 1;
+}
+
+void profile_add(ProfileStage stage, uint64_t ticks) {
+    prof.ticks[stage] += ticks;
+    prof.calls[stage]++;
+}
+
+void profile_tick(void) {
+    if (!profile_enabled) return;
+    uint64_t t = now_ms();
+    uint64_t span_ms = t - prof.last_dump_ms;
+    if (span_ms < prof.every_ms) return;
+
+    printf("{\"profile_ms\":%llu,\"stages\":{", (unsigned long long)span_ms);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        double ns = (double)prof.ticks[i] * prof.ns_per_tick;
+        printf("%s\"%s\":{\"calls\":%llu,\"ns\":%.0f,\"ns_per_call\":%.1f,\"pct\":%.2f}",
+               i ? "," : "", stage_names[i], (unsigned long long)prof.calls[i], ns,
+               prof.calls[i] ? ns / (double)prof.calls[i] : 0.0,
+               100.0 * ns / ((double)span_ms * 1e6));
+        prof.ticks[i] = 0;
+        prof.calls[i] = 0;
+    }
+    printf("}}\n");
+    fflush(stdout);
+    prof.last_dump_ms = t;
+}
@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Per-stage cycle accounting for the event loop. Stages are timed with the
+// TSC where available (clock_gettime ns otherwise) and summed until the next
+// dump; profile_tick() prints one JSON line per interval. Nested stages are
+// inclusive: dispatch contains heartbeat and enqueue.
+//
+// Disabled (the default), each probe site costs one predictable branch.
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef enum {
+    STAGE_READ,       // read() of the client socket
+    STAGE_DECODE,     // frame_length reassembly
+    STAGE_DISPATCH,   // handle_packet
+    STAGE_HEARTBEAT,  // heartbeat parse + echo build
+    STAGE_ENQUEUE,    // enqueue_message (inbox copy + WAL append)
+    STAGE_FORWARD,    // offline_flush (stored backlog to the socket)
+    STAGE_WRITE,      // output queue flush (sendmsg)
+    STAGE_COUNT
+} ProfileStage;
+
+extern int profile_enabled;
+
+void profile_enable(uint64_t dump_every_ms);
+void profile_add(ProfileStage stage, uint64_t ticks);
+void profile_tick(void);
+
+static inline uint64_t profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Returns 0 while disabled so the matching profile_end is a no-op.
+static inline uint64_t profile_begin(void) {
+    return __builtin_expect(profile_enabled, 0) ? profile_clock() : 0;
+}
+
+static inline void profile_end(ProfileStage stage, uint64_t t0) {
+    if (__builtin_expect(t0 != 0, 0)) profile_add(stage, profile_clock() - t0);
+}
+
+#endif
@@ -0,0 +1,81 @@
+// Per-source admission rate limiting: one token bucket per client address for
+// each check (accepting a connection, attempting auth), so a reconnect storm
+// is turned away before it reaches session slots or the auth backend.
+//
+// Buckets live in a fixed open-addressed table owned by the event loop, so no
+// locking is needed. A key probes RATE_PROBE slots; a new key takes an empty
+// slot, else the entry in its probe window with the fullest bucket. A full
+// bucket is indistinguishable from a fresh one, so evicting it loses nothing.
+
+#include <stdio.h>
+
+#include "heartbeat.h"
+
+#define RATE_SLOTS 4096          // power of two
+#define RATE_PROBE 4
+#define MILLI      1000u         // tokens are kept in thousandths
+
+typedef struct {
+    uint64_t key;                // 0 = empty
+    uint32_t tokens;             // milli-tokens
+    uint32_t last_ms;            // low 32 bits of the last refill time
+} RateBucket;
+
+static struct {
+    uint32_t per_sec;            // 0 = unlimited
+    uint32_t burst;
+    RateBucket table[RATE_SLOTS];
+} limiters[RATE_KIND_COUNT];
+
+static const char *const rejected_metric[RATE_KIND_COUNT] = {
+    "ratelimit_rejected_accept", "ratelimit_rejected_auth",
+};
+
+void ratelimit_configure(int kind, uint32_t per_sec, uint32_t burst) {
+    limiters[kind].per_sec = per_sec;
+    limiters[kind].burst = burst ? burst : per_sec;
+    printf("[info] %s rate limit: %u/s per source, burst %u\n",
+           kind == RATE_ACCEPT ? "accept" : "auth", per_sec, limiters[kind].burst);
+}
+
+// Buckets gain per_sec milli-tokens per millisecond, up to burst tokens.
+static void refill(RateBucket *b, uint32_t per_sec, uint32_t burst, uint32_t t) {
+    uint64_t tokens = b->tokens + (uint64_t)(uint32_t)(t - b->last_ms) * per_sec;
+    b->tokens = tokens > (uint64_t)burst * MILLI ? burst * MILLI : (uint32_t)tokens;
+    b->last_ms = t;
+}
+
+// Returns 1 when the source may proceed, 0 when it is over its rate.
+int ratelimit_admit(int kind, uint64_t key, uint64_t now) {
+    uint32_t per_sec = limiters[kind].per_sec, burst = limiters[kind].burst;
+    if (!per_sec) return 1;
+    RateBucket *table = limiters[kind].table;
+    key = (key ^ (key >> 31)) * 0x9e3779b97f4a7c15ULL;   // spread address bits over the index
+    key |= 1;
+    uint32_t t = (uint32_t)now;
+    RateBucket *b = NULL, *victim = NULL;
+    for (int i = 0; i < RATE_PROBE && !b; i++) {
+        RateBucket *p = &table[((key >> 20) + (uint64_t)i) & (RATE_SLOTS - 1)];
+        if (p->key == key) {
+            b = p;
+        } else if (!p->key) {
+            if (!victim || victim->key) victim = p;
+        } else if (!victim || victim->key) {
+            refill(p, per_sec, burst, t);
+            if (!victim || p->tokens > victim->tokens) victim = p;   // least active source
+        }
+    }
+    if (b) {
+        refill(b, per_sec, burst, t);
+    } else {
+        if (victim->key && victim->tokens < burst * MILLI) record_metric("ratelimit_evicted", 1);
+        *victim = (RateBucket){ key, burst * MILLI, t };
+        b = victim;
+    }
+    if (b->tokens < MILLI) {
+        record_metric(rejected_metric[kind], 1);
+        return 0;
+    }
+    b->tokens -= MILLI;
+    return 1;
+}
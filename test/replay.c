@@ -0,0 +1,128 @@
+// Deterministic replay of a gateway capture (see capture.c) through
+// handle_packet, either as fast as possible or at the recorded pacing.
+// The maintenance passes the event loop runs (auth batch, key rotation) are
+// interleaved every REPLAY_TICK frames, or on each 100 ms of recorded time
+// when paced. Prints one JSON summary line.
+//
+// build: cmake target replay (see CMakeLists.txt)
+// usage: replay CAPTURE [--paced] [--loops N]
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+
+#define REPLAY_TICK 64
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *out) {
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    uint64_t t = mono_ns();
+    if (t >= deadline_ns) return;
+    struct timespec ts = { (time_t)((deadline_ns - t) / 1000000000ULL),
+                           (long)((deadline_ns - t) % 1000000000ULL) };
+    nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s CAPTURE [--paced] [--loops N]\n", argv[0]);
+        return 2;
+    }
+    int paced = 0, loops = 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--paced") == 0) paced = 1;
+        else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc) loops = atoi(argv[++i]);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(CaptureHeader)) {
+        fprintf(stderr, "cannot read capture %s\n", argv[1]);
+        return 1;
+    }
+    const uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 1;
+    CaptureHeader hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION) {
+        fprintf(stderr, "not a gateway capture (or unsupported version)\n");
+        return 1;
+    }
+    if (hdr.max_clients > MAX_CLIENTS) {
+        fprintf(stderr, "capture used %u sessions; session ids are folded into %d\n",
+                hdr.max_clients, MAX_CLIENTS);
+    }
+
+    set_log_enabled(0);
+    init_sessions();
+    static uint8_t out[MAX_REPLY];
+    const uint8_t *end = map + st.st_size;
+    uint64_t frames = 0, bytes = 0, errors = 0;
+    uint64_t start = mono_ns();
+
+    for (int loop = 0; loop < loops; loop++) {
+        const uint8_t *p = map + sizeof(hdr);
+        uint64_t rec_ns = 0, last_tick_ns = 0, loop_start = mono_ns();
+        while (p < end) {
+            uint64_t dt_us, sid, len;
+            if (get_varint(&p, end, &dt_us) < 0 || get_varint(&p, end, &sid) < 0 ||
+                get_varint(&p, end, &len) < 0 || len > (uint64_t)(end - p)) {
+                fprintf(stderr, "truncated record after %llu frames\n", (unsigned long long)frames);
+                break;
+            }
+            rec_ns += dt_us * 1000;
+            if (paced) sleep_until(loop_start + rec_ns);
+            // Frames in a capture were already reassembled and length-checked by the server.
+            if (len > 0 && frame_length(p, (size_t)len) == (int)len) {
+                handle_packet(session_by_id((int)(sid % MAX_CLIENTS)), p, (size_t)len, out);
+            } else {
+                errors++;
+            }
+            p += len;
+            frames++;
+            bytes += len;
+            if (paced ? rec_ns - last_tick_ns >= 100000000ULL : frames % REPLAY_TICK == 0) {
+                flush_auth_batch();
+                run_key_rotations(MAX_CLIENTS);
+                last_tick_ns = rec_ns;
+            }
+        }
+        flush_auth_batch();
+        run_key_rotations(MAX_CLIENTS);
+    }
+
+    uint64_t elapsed = mono_ns() - start;
+    printf("{\"capture\":\"%s\",\"paced\":%d,\"loops\":%d,\"frames\":%llu,\"bytes\":%llu,"
+           "\"invalid\":%llu,\"elapsed_ms\":%.2f,\"ns_per_frame\":%.1f,\"frames_per_sec\":%.0f}\n",
+           argv[1], paced, loops, (unsigned long long)frames, (unsigned long long)bytes,
+           (unsigned long long)errors, (double)elapsed / 1e6,
+           frames ? (double)elapsed / (double)frames : 0.0,
+           elapsed ? (double)frames * 1e9 / (double)elapsed : 0.0);
+    return 0;
+}
@@ -0,0 +1,157 @@
+// Optional UDP heartbeat port. Each datagram is
+//   ticket(8, big-endian) + heartbeat frame (0x01, len16, payload)
+// where ticket is the session's current resume ticket (the MSG_TICKET reply), so a
+// heartbeat is bound to an authenticated session without a TCP round trip.
+// The echo goes back to the sender as a datagram carrying the same message
+// the TCP path would send. Up to UDP_BATCH datagrams are read per recvmmsg()
+// and all replies from a batch leave in one sendmmsg().
+//
+// The socket uses SO_REUSEPORT so a takeover successor can bind alongside its
+// predecessor; datagrams landing on the old process during the overlap are
+// dropped like any other lost heartbeat.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+
+#define UDP_BATCH     64
+#define UDP_TICKET    8
+#define UDP_DGRAM_MAX (UDP_TICKET + MAX_FRAME)
+#define UDP_MAP_CAP   (2 * MAX_CLIENTS)   // ticket -> sid, at most half live
+#define UDP_MAP_PROBE 8
+
+static int udp_fd = -1;
+
+static struct {
+    uint8_t in[UDP_BATCH][UDP_DGRAM_MAX];
+    uint8_t out[UDP_BATCH][MAX_REPLY];
+    struct sockaddr_storage peer[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH], out_iov[UDP_BATCH];
+    struct mmsghdr in_msg[UDP_BATCH], out_msg[UDP_BATCH];
+} udp;
+
+static struct {
+    uint64_t ticket;
+    int sid;
+} ticket_map[UDP_MAP_CAP];
+
+int udp_heartbeat_open(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port),
+                                .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < UDP_BATCH; i++) {
+        udp.in_iov[i] = (struct iovec){ udp.in[i], sizeof(udp.in[i]) };
+        udp.in_msg[i].msg_hdr.msg_iov = &udp.in_iov[i];
+        udp.in_msg[i].msg_hdr.msg_iovlen = 1;
+    }
+    udp_fd = fd;
+    return 0;
+}
+
+int udp_heartbeat_fd(void) {
+    return udp_fd;
+}
+
+void udp_heartbeat_close(void) {
+    if (udp_fd >= 0) close(udp_fd);
+    udp_fd = -1;
+}
+
+// An entry is live while its session is authenticated and still holds the
+// ticket; tickets change on auth, resume and disconnect.
+static int ticket_live(int slot) {
+    if (!ticket_map[slot].ticket) return 0;
+    ClientSession *s = session_by_id(ticket_map[slot].sid);
+    return s->resume_ticket == ticket_map[slot].ticket && s->authenticated;
+}
+
+// Called whenever a session gets a ticket. Takes the first slot in the probe
+// window that is free, stale or the session's own, else evicts the last one.
+void udp_ticket_issued(int sid, uint64_t ticket) {
+    int slot = 0;
+    for (int i = 0; i < UDP_MAP_PROBE; i++) {
+        slot = (int)((ticket + (uint64_t)i) % UDP_MAP_CAP);
+        if (!ticket_live(slot) || ticket_map[slot].sid == sid) break;
+        if (i == UDP_MAP_PROBE - 1) record_metric("udp_ticket_evicted", 1);
+    }
+    ticket_map[slot].ticket = ticket;
+    ticket_map[slot].sid = sid;
+}
+
+// Datagrams whose ticket is not in the map are dropped; nothing scans the
+// session table on the packet path.
+static ClientSession *session_by_ticket(uint64_t ticket) {
+    if (!ticket) return NULL;
+    for (int i = 0; i < UDP_MAP_PROBE; i++) {
+        int slot = (int)((ticket + (uint64_t)i) % UDP_MAP_CAP);
+        if (ticket_map[slot].ticket == ticket && ticket_live(slot)) return session_by_id(ticket_map[slot].sid);
+    }
+    record_metric("udp_unknown_ticket", 1);
+    return NULL;
+}
+
+// Drains the socket; returns the number of heartbeats echoed.
+int udp_heartbeat_service(void) {
+    if (udp_fd < 0) return 0;
+    int echoed = 0;
+    for (;;) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            udp.in_msg[i].msg_hdr.msg_name = &udp.peer[i];
+            udp.in_msg[i].msg_hdr.msg_namelen = sizeof(udp.peer[i]);
+        }
+        int n = recvmmsg(udp_fd, udp.in_msg, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) break;
+        record_metric("udp_batch", 1);
+
+        uint64_t t = now_ms();
+        int replies = 0;
+        for (int i = 0; i < n; i++) {
+            const uint8_t *d = udp.in[i];
+            size_t len = udp.in_msg[i].msg_len;
+            if (len < UDP_TICKET + 3 || d[UDP_TICKET] != 0x01 ||
+                frame_length(d + UDP_TICKET, len - UDP_TICKET) != (int)(len - UDP_TICKET)) {
+                record_metric("udp_malformed", 1);
+                continue;
+            }
+            uint64_t ticket = 0;
+            for (int b = 0; b < UDP_TICKET; b++) ticket = (ticket << 8) | d[b];
+            ClientSession *s = session_by_ticket(ticket);
+            if (!s) continue;
+            int rc = handle_packet(s, d + UDP_TICKET, len - UDP_TICKET, udp.out[replies]);
+            // Liveness over UDP counts for server probes too; a probe answer
+            // is not echoed, as on TCP.
+            if (rc >= 0 && keepalive_activity(s->id, t, d + UDP_TICKET, len - UDP_TICKET)) continue;
+            if (rc <= 0) continue;
+            udp.out_iov[replies] = (struct iovec){ udp.out[replies], (size_t)rc };
+            udp.out_msg[replies].msg_hdr = (struct msghdr){
+                .msg_name = &udp.peer[i], .msg_namelen = udp.in_msg[i].msg_hdr.msg_namelen,
+                .msg_iov = &udp.out_iov[replies], .msg_iovlen = 1 };
+            replies++;
+        }
+        for (int sent = 0; sent < replies;) {
+            int m = sendmmsg(udp_fd, udp.out_msg + sent, (unsigned)(replies - sent), MSG_DONTWAIT);
+            if (m <= 0) {
+                if (m < 0 && errno != EAGAIN) printf("[warn] udp sendmmsg failed\n");
+                record_metric("udp_echo_dropped", replies - sent);
+                break;
+            }
+            sent += m;
+            echoed += m;
+        }
+        if (n < UDP_BATCH) break;
+    }
+    return echoed;
+}
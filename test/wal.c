@@ -0,0 +1,461 @@
+// Write-ahead log of accepted chat payloads.
+// Appends are buffered on the event loop and made durable by group commit on
+// a writer thread: each batch is one write() plus one fdatasync(), and the
+// loop keeps buffering the next batch meanwhile, so a disk flush never stalls
+// it. Chat frames are not acknowledged on the wire; a batch counts as
+// committed once the writer reports it synced. The loop only waits for the
+// writer when a full buffer has to go out while the previous batch is still
+// syncing, or when a commit is forced.
+// Each segment after the first starts with a snapshot of every non-empty
+// inbox, so once a new segment is synced the older ones can be deleted and
+// replay stays short. A snapshot supersedes everything before it, so replay
+// stays correct if a crash leaves the old segments behind.
+//
+// Slots are reused by whoever connects next, so records also name the owner
+// of each inbox (user and resume ticket). Replay hands every recovered inbox
+// back to its owner (restore_inbox) and then starts a fresh segment, so the
+// same bytes are not recovered twice.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heartbeat.h"
+
+#define WAL_BUF_CAP       (64 * 1024)
+#define WAL_SEGMENT_BYTES (64u * 1024 * 1024)   // default rotation size
+#define WAL_MAGIC         0x4757414cu           // "GWAL"
+#define WAL_VERSION       3
+#define WAL_REC_APPEND    1
+#define WAL_REC_CLEAR     2
+#define WAL_REC_SNAPSHOT  3   // empties every inbox; the snapshot's appends follow
+#define WAL_REC_OWNER     4   // ticket(8) + user: who the inbox of sid belongs to
+#define WAL_NO_ROTATE     ((size_t)-1)
+
+// Start of every segment; records follow.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} WalSegmentHeader;
+
+// Record header; the payload follows. crc covers sid, type, len and payload.
+typedef struct {
+    uint32_t crc;
+    uint32_t sid;
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t len;
+} WalRecord;
+
+// Event-loop side.
+static struct {
+    char dir[256];
+    uint64_t sync_interval_us;
+    uint64_t segment_limit;    // rotate once a segment reaches this size
+    int open;
+    uint64_t segment_bytes;    // submitted to the current segment so far
+    uint8_t bufs[2][WAL_BUF_CAP];
+    uint8_t *buf;              // the one being filled; the other may be in flight
+    size_t buf_len;
+    size_t rotate_at;          // start of the snapshot in buf, or WAL_NO_ROTATE
+    uint64_t last_submit_us;
+    int replayed;              // wal_open() starts a new segment
+} wal = { .rotate_at = WAL_NO_ROTATE };
+
+// Writer thread side. Only it touches fd and segment once it runs.
+static struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    unsigned segment;
+    const uint8_t *batch;      // handed over by the loop, NULL when idle
+    size_t len, rotate_at;
+    int stop;
+    int failed;                // a batch failed since the loop last looked
+    int syncs, rotations;      // reported by the loop, which owns the metrics
+} writer = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+// An inbox rebuilt by wal_replay(), with its owner.
+typedef struct {
+    char user[64];
+    uint64_t ticket;
+    uint8_t inbox[MAX_MSG];
+    size_t len;
+} RecoveredInbox;
+
+static RecoveredInbox recovered[MAX_CLIENTS];
+
+static uint32_t crc_table[256];
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t n) {
+    if (!crc_table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (n--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const WalRecord *r, const uint8_t *payload) {
+    uint32_t crc = crc32_update(0, (const uint8_t *)&r->sid, sizeof(*r) - sizeof(r->crc));
+    return crc32_update(crc, payload, r->len);
+}
+
+static void segment_path(char *out, size_t cap, unsigned segment) {
+    snprintf(out, cap, "%s/wal-%08u.log", wal.dir, segment);
+}
+
+static int is_segment(const struct dirent *d) {
+    return strncmp(d->d_name, "wal-", 4) == 0;
+}
+
+// Segment numbers present in the directory, ascending. Caller frees.
+static int list_segments(unsigned **out) {
+    struct dirent **names;
+    int n = scandir(wal.dir, &names, is_segment, alphasort);
+    if (n < 0) return -1;
+    *out = malloc(sizeof(unsigned) * (size_t)(n ? n : 1));
+    for (int i = 0; i < n; i++) {
+        (*out)[i] = (unsigned)strtoul(names[i]->d_name + 4, NULL, 10);
+        free(names[i]);
+    }
+    free(names);
+    return n;
+}
+
+// ---- writer thread ----------------------------------------------------------
+
+static int open_segment(unsigned segment) {
+    char path[300];
+    segment_path(path, sizeof(path), segment);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    struct stat st;
+    WalSegmentHeader hdr = { WAL_MAGIC, WAL_VERSION };
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size == 0 && write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))) {
+        close(fd);
+        return -1;
+    }
+    if (writer.fd >= 0) close(writer.fd);
+    writer.fd = fd;
+    writer.segment = segment;
+    return 0;
+}
+
+static int write_all(const uint8_t *p, size_t len) {
+    while (len) {
+        ssize_t n = write(writer.fd, p, len);
+        if (n < 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Writes and syncs one batch. With rotate_at set, the bytes before it finish
+// the current segment and the rest (a snapshot and what followed it) start
+// the next one; once that is synced, the older segments go.
+static int write_batch(const uint8_t *p, size_t len, size_t rotate_at) {
+    if (rotate_at == WAL_NO_ROTATE) return write_all(p, len) < 0 || fdatasync(writer.fd) < 0 ? -1 : 1;
+    unsigned old = writer.segment;
+    if (write_all(p, rotate_at) < 0 || fdatasync(writer.fd) < 0 || open_segment(old + 1) < 0 ||
+        write_all(p + rotate_at, len - rotate_at) < 0 || fdatasync(writer.fd) < 0) {
+        return -1;
+    }
+    for (unsigned seg = 0; seg <= old; seg++) {
+        char path[300];
+        segment_path(path, sizeof(path), seg);
+        unlink(path);
+    }
+    return 2;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&writer.lock);
+    for (;;) {
+        while (!writer.batch && !writer.stop) pthread_cond_wait(&writer.cond, &writer.lock);
+        if (!writer.batch) break;
+        const uint8_t *p = writer.batch;
+        size_t len = writer.len, rotate_at = writer.rotate_at;
+        pthread_mutex_unlock(&writer.lock);
+        int rc = write_batch(p, len, rotate_at);
+        pthread_mutex_lock(&writer.lock);
+        if (rc < 0) writer.failed = 1;
+        writer.syncs += rc > 0;
+        writer.rotations += rc == 2;
+        writer.batch = NULL;
+        pthread_cond_broadcast(&writer.cond);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return NULL;
+}
+
+// ---- event loop side --------------------------------------------------------
+
+// Waits for the batch in flight, if any. Call with writer.lock held.
+static void wait_writer(void) {
+    while (writer.batch) pthread_cond_wait(&writer.cond, &writer.lock);
+}
+
+// Hands the filled buffer to the writer and switches to the other one. With
+// wait set, returns only once it is synced.
+static void submit(int wait) {
+    pthread_mutex_lock(&writer.lock);
+    wait_writer();
+    if (wal.buf_len) {
+        writer.batch = wal.buf;
+        writer.len = wal.buf_len;
+        writer.rotate_at = wal.rotate_at;
+        pthread_cond_signal(&writer.cond);
+        if (wal.rotate_at != WAL_NO_ROTATE) wal.segment_bytes = sizeof(WalSegmentHeader) + wal.buf_len - wal.rotate_at;
+        else wal.segment_bytes += wal.buf_len;
+        wal.buf = wal.buf == wal.bufs[0] ? wal.bufs[1] : wal.bufs[0];
+        wal.buf_len = 0;
+        wal.rotate_at = WAL_NO_ROTATE;
+        wal.last_submit_us = mono_us();
+    }
+    if (wait) wait_writer();
+    pthread_mutex_unlock(&writer.lock);
+}
+
+static void buffer_record(int sid, uint8_t type, const uint8_t *payload, size_t len) {
+    WalRecord r = { 0, (uint32_t)sid, type, { 0 }, (uint32_t)len };
+    // A full buffer goes out now, waiting out the batch in flight: the disk
+    // is not keeping up.
+    if (wal.buf_len + sizeof(r) + len > WAL_BUF_CAP) submit(0);
+    r.crc = record_crc(&r, payload);
+    memcpy(wal.buf + wal.buf_len, &r, sizeof(r));
+    if (len) memcpy(wal.buf + wal.buf_len + sizeof(r), payload, len);
+    wal.buf_len += sizeof(r) + len;
+}
+
+// segment_bytes of 0 keeps the default rotation size.
+void wal_configure(const char *dir, uint64_t sync_interval_us, uint64_t segment_bytes) {
+    snprintf(wal.dir, sizeof(wal.dir), "%s", dir);
+    wal.sync_interval_us = sync_interval_us;
+    wal.segment_limit = segment_bytes ? segment_bytes : WAL_SEGMENT_BYTES;
+}
+
+static void buffer_owner(int sid, const char *user, uint64_t ticket) {
+    uint8_t rec[8 + 64];
+    size_t len = strnlen(user, 63);
+    memcpy(rec, &ticket, 8);
+    memcpy(rec + 8, user, len);
+    buffer_record(sid, WAL_REC_OWNER, rec, 8 + len);
+}
+
+// Marks the rest of the buffer as the start of a new segment: a snapshot of
+// every non-empty inbox, then whatever is appended after it.
+static void start_rotation(void) {
+    if (wal.buf_len + sizeof(WalRecord) > WAL_BUF_CAP) submit(0);
+    wal.rotate_at = wal.buf_len;
+    buffer_record(0, WAL_REC_SNAPSHOT, NULL, 0);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientSession *s = session_by_id(i);
+        if (!s->inbox_len) continue;
+        buffer_owner(i, s->user, s->resume_ticket);
+        buffer_record(i, WAL_REC_APPEND, s->inbox, s->inbox_len);
+    }
+}
+
+// Opens the newest segment for appending and starts the writer. No-op unless
+// wal_configure() ran. After a replay the log starts over from a snapshot of
+// the (empty) inboxes.
+int wal_open(void) {
+    if (!wal.dir[0]) return 0;
+    mkdir(wal.dir, 0700);
+    unsigned *segs;
+    int n = list_segments(&segs);
+    if (n < 0) return -1;
+    unsigned last = n ? segs[n - 1] : 0;
+    free(segs);
+    if (open_segment(last) < 0) return -1;
+    struct stat st;
+    wal.segment_bytes = fstat(writer.fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    wal.buf = wal.bufs[0];
+    wal.buf_len = 0;
+    wal.rotate_at = WAL_NO_ROTATE;
+    wal.last_submit_us = mono_us();
+    writer.stop = 0;
+    writer.failed = 0;
+    if (pthread_create(&writer.tid, NULL, writer_main, NULL) != 0) {
+        close(writer.fd);
+        writer.fd = -1;
+        return -1;
+    }
+    wal.open = 1;
+    if (!wal.replayed) return 0;
+    wal.replayed = 0;
+    start_rotation();
+    return wal_commit(1);
+}
+
+void wal_append(int sid, const uint8_t *payload, size_t len) {
+    if (!wal.open) return;
+    buffer_record(sid, WAL_REC_APPEND, payload, len);
+}
+
+void wal_clear(int sid) {
+    if (!wal.open) return;
+    buffer_record(sid, WAL_REC_CLEAR, NULL, 0);
+}
+
+// Records who the inbox of sid belongs to from here on.
+void wal_owner(int sid, const char *user, uint64_t ticket) {
+    if (!wal.open) return;
+    buffer_owner(sid, user, ticket);
+}
+
+// Buffered records not yet handed to the writer; the loop polls quickly
+// while there are some.
+int wal_pending(void) {
+    return wal.open && wal.buf_len;
+}
+
+// Called once per loop iteration. Hands buffered records to the writer once
+// the group-commit interval has passed and the previous batch is synced;
+// force waits until everything buffered so far is synced. Returns -1 if a
+// batch failed since the last call.
+int wal_commit(int force) {
+    if (!wal.open) return 0;
+    if (wal.segment_bytes + wal.buf_len >= wal.segment_limit && wal.rotate_at == WAL_NO_ROTATE) start_rotation();
+    pthread_mutex_lock(&writer.lock);
+    int idle = !writer.batch;
+    pthread_mutex_unlock(&writer.lock);
+    if (force || (idle && wal.buf_len && mono_us() - wal.last_submit_us >= wal.sync_interval_us)) submit(force);
+    pthread_mutex_lock(&writer.lock);
+    int failed = writer.failed, syncs = writer.syncs, rotations = writer.rotations;
+    writer.failed = writer.syncs = writer.rotations = 0;
+    pthread_mutex_unlock(&writer.lock);
+    if (syncs) record_metric("wal_sync", syncs);
+    if (rotations) record_metric("wal_rotate", rotations);
+    return failed ? -1 : 0;
+}
+
+void wal_close(void) {
+    if (!wal.open) return;
+    if (wal_commit(1) < 0) printf("[warn] wal commit failed\n");
+    pthread_mutex_lock(&writer.lock);
+    writer.stop = 1;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.tid, NULL);
+    close(writer.fd);
+    writer.fd = -1;
+    wal.open = 0;
+}
+
+// Applies one segment to the recovered inboxes. Returns the offset of the first record
+// that failed to parse (the torn tail after a crash), or the file size; 0 for
+// a segment torn before its header was complete.
+static off_t replay_segment(const char *path, int *applied) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(WalSegmentHeader)) {
+        close(fd);
+        return 0;
+    }
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    WalSegmentHeader hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    size_t off = sizeof(hdr), size = (size_t)st.st_size;
+    if (hdr.magic != WAL_MAGIC || hdr.version != WAL_VERSION) {
+        // Not ours to truncate: an older format or a foreign file.
+        printf("[warn] wal segment %s: unknown format\n", path);
+        munmap(map, size);
+        return -1;
+    }
+    while (off + sizeof(WalRecord) <= size) {
+        WalRecord r;
+        memcpy(&r, map + off, sizeof(r));
+        const uint8_t *payload = map + off + sizeof(r);
+        if (r.len > MAX_MSG || r.sid >= MAX_CLIENTS || off + sizeof(r) + r.len > size ||
+            record_crc(&r, payload) != r.crc) {
+            break;
+        }
+        RecoveredInbox *s = &recovered[r.sid];
+        if (r.type == WAL_REC_SNAPSHOT) {
+            for (int i = 0; i < MAX_CLIENTS; i++) recovered[i].len = 0;
+        } else if (r.type == WAL_REC_CLEAR) {
+            s->len = 0;
+        } else if (r.type == WAL_REC_OWNER) {
+            if (r.len >= 8) {
+                memcpy(&s->ticket, payload, 8);
+                snprintf(s->user, sizeof(s->user), "%.*s", (int)(r.len - 8), (const char *)payload + 8);
+            }
+        } else if (r.len <= MAX_MSG - s->len) {
+            memcpy(s->inbox + s->len, payload, r.len);
+            s->len += r.len;
+        }
+        off += sizeof(r) + r.len;
+        (*applied)++;
+    }
+    munmap(map, size);
+    return (off_t)off;
+}
+
+// Rebuilds every inbox from the log and returns it to its owner; run before
+// wal_open(), after the offline store is open. A torn tail on the newest
+// segment is cut off so new appends land right after the last good record.
+int wal_replay(void) {
+    if (!wal.dir[0]) return 0;
+    unsigned *segs;
+    int n = list_segments(&segs);
+    if (n < 0) return mkdir(wal.dir, 0700) < 0 ? -1 : 0;
+    if (n == 0) {
+        free(segs);
+        return 0;
+    }
+    memset(recovered, 0, sizeof(recovered));
+
+    int applied = 0;
+    for (int i = 0; i < n; i++) {
+        char path[300];
+        segment_path(path, sizeof(path), segs[i]);
+        off_t good = replay_segment(path, &applied);
+        if (good >= 0 && i == n - 1 && truncate(path, good) < 0) good = -1;
+        if (good < 0) {
+            free(segs);
+            return -1;
+        }
+    }
+    free(segs);
+    int restored = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!recovered[i].len) continue;
+        if (restore_inbox(recovered[i].user, recovered[i].ticket, recovered[i].inbox, recovered[i].len) < 0) {
+            printf("[warn] wal: %zu bytes of session %d have no owner to return to\n", recovered[i].len, i);
+            continue;
+        }
+        restored++;
+    }
+    wal.replayed = 1;
+    printf("[info] wal replayed %d records, %d inboxes returned to their users\n", applied, restored);
+    return applied;
+}